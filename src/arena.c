@@ -0,0 +1,111 @@
+#include <stdlib.h>
+
+#include "iito.h"
+
+/* The runtime model, i.e. everything that is derived from the config
+ * and lives for as long as the daemon, is allocated from a single
+ * arena of large chunks. Objects that are probed in sequence end up
+ * next to each other, and nothing is ever freed.
+ *
+ * Strings are interned, so that names appearing in multiple places of
+ * the config, e.g. an input and every rule that references it, are
+ * only stored once. */
+
+#define ARENA_CHUNK 0x4000
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct arena_str {
+	struct hnode node;
+	char str[];
+};
+
+static struct {
+	struct arena_chunk *chunks;
+	size_t size;
+	size_t n_chunks;
+
+	struct htab strs;
+} g_arena;
+
+static struct arena_chunk *arena_chunk_new(size_t size)
+{
+	struct arena_chunk *chunk;
+
+	if (size < ARENA_CHUNK)
+		size = ARENA_CHUNK;
+
+	chunk = calloc(1, sizeof(*chunk) + size);
+	assert(chunk);
+
+	chunk->size = size;
+	g_arena.size += sizeof(*chunk) + size;
+	g_arena.n_chunks++;
+	return chunk;
+}
+
+void *arena_alloc(size_t size)
+{
+	struct arena_chunk *chunk = g_arena.chunks;
+	void *obj;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		chunk = arena_chunk_new(size);
+
+		/* Keep filling the current chunk if the new one was
+		 * sized for this object alone. */
+		if (g_arena.chunks && size >= ARENA_CHUNK) {
+			chunk->next = g_arena.chunks->next;
+			g_arena.chunks->next = chunk;
+		} else {
+			chunk->next = g_arena.chunks;
+			g_arena.chunks = chunk;
+		}
+	}
+
+	obj = &chunk->data[chunk->used];
+	chunk->used += size;
+	return obj;
+}
+
+void *arena_allocarray(size_t n, size_t size)
+{
+	assert(!size || n <= SIZE_MAX / size);
+	return arena_alloc(n * size);
+}
+
+const char *arena_strdup(const char *str)
+{
+	struct arena_str *astr;
+	struct hnode *hn;
+	size_t len;
+
+	if (!str)
+		return NULL;
+
+	hn = htab_find(&g_arena.strs, str);
+	if (hn)
+		return hn->key;
+
+	len = strlen(str);
+	astr = arena_alloc(sizeof(*astr) + len + 1);
+	memcpy(astr->str, str, len + 1);
+
+	htab_add(&g_arena.strs, &astr->node, astr->str);
+	return astr->str;
+}
+
+void arena_log(void)
+{
+	log_not("Compiled model: %zu bytes in %zu chunks, %zu unique strings",
+		g_arena.size, g_arena.n_chunks, g_arena.strs.n);
+}
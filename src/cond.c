@@ -0,0 +1,470 @@
+#include <stdlib.h>
+
+#include "iito.h"
+
+/* Conditions form a DAG, whose leaves are input properties. Each
+ * distinct (sub-)expression, regardless of how many rules it appears
+ * in, is represented by a single node that owns a bit in the input
+ * state vector.
+ *
+ * When properties flip, their ancestors are queued and reevaluated
+ * in order of increasing depth, so that every affected node is
+ * evaluated exactly once per pass, after all of its arguments. */
+
+static struct htab g_conds;
+
+static struct cond **g_cond_list;
+static size_t g_cond_list_n;
+
+static struct {
+	struct cond **conds;
+	size_t n;
+} *g_cond_work;
+static size_t g_cond_work_n;
+
+static void cond_add_parent(struct cond *cond, struct cond *parent)
+{
+	struct cond **parents;
+
+	parents = reallocarray(cond->parents, cond->n_parents + 1,
+			       sizeof(*parents));
+	assert(parents);
+
+	parents[cond->n_parents++] = parent;
+	cond->parents = parents;
+}
+
+/* Look up the node of an expression, or create it. Both args and expr
+ * are temporary, and are released by this function. */
+static struct cond *cond_intern(enum cond_op op, struct cond **args,
+				size_t n_args, char *expr)
+{
+	struct cond *cond, **list;
+	struct hnode *hn;
+	size_t i;
+
+	hn = htab_find(&g_conds, expr);
+	if (hn) {
+		free(expr);
+		free(args);
+		return container_of(hn, struct cond, node);
+	}
+
+	cond = arena_alloc(sizeof(*cond));
+
+	*cond = (struct cond) {
+		.op = op,
+		.args = arena_allocarray(n_args, sizeof(*args)),
+		.n_args = n_args,
+		.bit = in_state_alloc(),
+	};
+
+	memcpy(cond->args, args, n_args * sizeof(*args));
+	free(args);
+
+	for (i = 0; i < n_args; i++) {
+		if (cond->args[i]->depth >= cond->depth)
+			cond->depth = cond->args[i]->depth + 1;
+
+		cond_add_parent(cond->args[i], cond);
+	}
+
+	htab_add(&g_conds, &cond->node, arena_strdup(expr));
+	free(expr);
+
+	/* Arguments are always created before their parents, so this
+	 * list is in topological order. */
+	list = reallocarray(g_cond_list, g_cond_list_n + 1, sizeof(*list));
+	assert(list);
+	list[g_cond_list_n++] = cond;
+	g_cond_list = list;
+	return cond;
+}
+
+static struct cond *cond_leaf(struct in_prop *iprop)
+{
+	struct cond *cond;
+	char *expr;
+	int len;
+
+	if (iprop->cond)
+		return iprop->cond;
+
+	cond = arena_alloc(sizeof(*cond));
+
+	if (iprop->name)
+		len = asprintf(&expr, "%s:%s", iprop->idev->name, iprop->name);
+	else
+		len = asprintf(&expr, "%s", iprop->idev->name);
+	assert(len >= 0);
+
+	*cond = (struct cond) {
+		.op = COND_PROP,
+		.iprop = iprop,
+		.bit = iprop->bit,
+	};
+
+	/* Leaves are not evaluated, so they are never listed */
+	htab_add(&g_conds, &cond->node, arena_strdup(expr));
+	free(expr);
+
+	iprop->cond = cond;
+	return cond;
+}
+
+static struct cond *cond_not(struct cond *arg)
+{
+	struct cond **args;
+	char *expr;
+	int len;
+
+	if (arg->op == COND_PROP)
+		len = asprintf(&expr, "!%s", cond_expr(arg));
+	else
+		len = asprintf(&expr, "!(%s)", cond_expr(arg));
+	assert(len >= 0);
+
+	args = calloc(1, sizeof(*args));
+	assert(args);
+
+	args[0] = arg;
+	return cond_intern(COND_NOT, args, 1, expr);
+}
+
+/* A parsed sub-expression that may still be negated. Negations are
+ * only materialized as nodes when they are used as an argument, so
+ * that a negated top-level expression can instead be handled by the
+ * rule's invert flag. */
+struct cond_lit {
+	struct cond *cond;
+	bool neg;
+};
+
+static struct cond *cond_lit_get(struct cond_lit lit)
+{
+	if (!lit.neg)
+		return lit.cond;
+
+	if (lit.cond->op == COND_NOT)
+		return lit.cond->args[0];
+
+	return cond_not(lit.cond);
+}
+
+static int cond_cmp(const void *_a, const void *_b)
+{
+	const struct cond * const *a = _a, * const *b = _b;
+
+	return strcmp(cond_expr(*a), cond_expr(*b));
+}
+
+/* Flatten nested operations of the same kind, and sort and dedupe the
+ * arguments, such that "a && (c && b)" and "b && a && c" end up as the
+ * same node. */
+static struct cond_lit cond_nary(enum cond_op op, struct cond_lit *lits, size_t n_lits)
+{
+	const char *sep = op == COND_AND ? " && " : " || ";
+	size_t i, j, n_args = 0, len;
+	struct cond **args = NULL;
+	struct cond *arg;
+	char *expr, *p;
+
+	for (i = 0; i < n_lits; i++) {
+		arg = cond_lit_get(lits[i]);
+
+		if (arg->op == op) {
+			args = reallocarray(args, n_args + arg->n_args, sizeof(*args));
+			assert(args);
+
+			for (j = 0; j < arg->n_args; j++)
+				args[n_args++] = arg->args[j];
+		} else {
+			args = reallocarray(args, n_args + 1, sizeof(*args));
+			assert(args);
+
+			args[n_args++] = arg;
+		}
+	}
+
+	qsort(args, n_args, sizeof(*args), cond_cmp);
+
+	for (i = 1, j = 1; i < n_args; i++)
+		if (args[i] != args[j - 1])
+			args[j++] = args[i];
+
+	n_args = j;
+
+	if (n_args == 1) {
+		arg = args[0];
+		free(args);
+		return (struct cond_lit) { .cond = arg };
+	}
+
+	for (i = 0, len = 0; i < n_args; i++)
+		len += strlen(cond_expr(args[i])) + strlen(sep) + 2;
+
+	expr = p = malloc(len + 1);
+	assert(expr);
+
+	for (i = 0; i < n_args; i++)
+		p += sprintf(p, args[i]->op == COND_PROP || args[i]->op == COND_NOT ?
+			     "%s%s" : "%s(%s)", i ? sep : "", cond_expr(args[i]));
+
+	return (struct cond_lit) { .cond = cond_intern(op, args, n_args, expr) };
+}
+
+
+/* Parser for expressions like "!maintenance && (power-1:online || power-2:online)"
+ *
+ *   expr    := and ( "||" and )*
+ *   and     := unary ( "&&" unary )*
+ *   unary   := "!" unary | "(" expr ")" | <input>[:<property>]
+ */
+
+struct cond_parser {
+	const char *expr;
+	const char *p;
+	int err;
+};
+
+#define cond_parse_err(_cp, _fmt, ...)					\
+	log_err("Condition \"%s\", at offset %td: " _fmt,		\
+		(_cp)->expr, (_cp)->p - (_cp)->expr, ##__VA_ARGS__)
+
+static void cond_parse_ws(struct cond_parser *cp)
+{
+	while (*cp->p == ' ' || *cp->p == '\t')
+		cp->p++;
+}
+
+static struct cond_lit cond_parse_or(struct cond_parser *cp);
+
+static struct cond_lit cond_parse_unary(struct cond_parser *cp)
+{
+	struct cond_lit lit = { 0 };
+	struct in_prop *iprop;
+	const char *start;
+	struct hnode *hn;
+	char *nameprop;
+
+	cond_parse_ws(cp);
+
+	if (*cp->p == '!') {
+		cp->p++;
+
+		lit = cond_parse_unary(cp);
+		lit.neg = !lit.neg;
+		return lit;
+	}
+
+	if (*cp->p == '(') {
+		cp->p++;
+
+		lit = cond_parse_or(cp);
+		if (cp->err)
+			return lit;
+
+		cond_parse_ws(cp);
+		if (*cp->p != ')') {
+			cond_parse_err(cp, "Expected \")\"");
+			cp->err = -EINVAL;
+			return lit;
+		}
+
+		cp->p++;
+		return lit;
+	}
+
+	for (start = cp->p; *cp->p && !strchr(" \t()!&|", *cp->p); cp->p++);
+
+	if (cp->p == start) {
+		cond_parse_err(cp, "Expected input");
+		cp->err = -EINVAL;
+		return lit;
+	}
+
+	nameprop = strndup(start, cp->p - start);
+	assert(nameprop);
+
+	/* Inputs are typically referenced by many rules, so first
+	 * look for an existing leaf, which is keyed by the same
+	 * "<input>[:<property>]" string. Other nodes' keys always
+	 * contain characters that end a token. */
+	hn = htab_find(&g_conds, nameprop);
+	if (hn) {
+		lit.cond = container_of(hn, struct cond, node);
+		free(nameprop);
+		return lit;
+	}
+
+	cp->err = in_prop_find(nameprop, &iprop);
+	if (cp->err)
+		cond_parse_err(cp, "Unknown input \"%s\"", nameprop);
+	else
+		lit.cond = cond_leaf(iprop);
+
+	free(nameprop);
+	return lit;
+}
+
+static struct cond_lit cond_parse_nary(struct cond_parser *cp, enum cond_op op)
+{
+	const char *tok = op == COND_AND ? "&&" : "||";
+	struct cond_lit *lits = NULL, lit;
+	size_t n_lits = 0;
+
+	for (;;) {
+		lit = op == COND_AND ? cond_parse_unary(cp) : cond_parse_nary(cp, COND_AND);
+		if (cp->err)
+			break;
+
+		lits = reallocarray(lits, n_lits + 1, sizeof(*lits));
+		assert(lits);
+		lits[n_lits++] = lit;
+
+		cond_parse_ws(cp);
+		if (strncmp(cp->p, tok, 2))
+			break;
+
+		cp->p += 2;
+	}
+
+	if (!cp->err && n_lits > 1)
+		lit = cond_nary(op, lits, n_lits);
+	else if (!cp->err)
+		lit = lits[0];
+
+	free(lits);
+	return lit;
+}
+
+static struct cond_lit cond_parse_or(struct cond_parser *cp)
+{
+	return cond_parse_nary(cp, COND_OR);
+}
+
+int cond_parse(const char *expr, struct cond **condp, bool *invertp)
+{
+	struct cond_parser cp = { .expr = expr, .p = expr };
+	struct cond_lit lit;
+
+	lit = cond_parse_or(&cp);
+	if (cp.err)
+		return cp.err;
+
+	cond_parse_ws(&cp);
+	if (*cp.p) {
+		cond_parse_err(&cp, "Unexpected \"%s\"", cp.p);
+		return -EINVAL;
+	}
+
+	/* Deduplication may leave a lone negation, e.g. "!a && !a",
+	 * which is folded into the rule as well. */
+	if (lit.cond->op == COND_NOT && !lit.neg) {
+		*condp = lit.cond->args[0];
+		*invertp = true;
+		return 0;
+	}
+
+	*condp = lit.cond;
+	*invertp = lit.neg;
+	return 0;
+}
+
+
+/* Evaluation */
+
+static bool cond_eval(const struct cond *cond, const uint64_t *state)
+{
+	size_t i;
+
+	switch (cond->op) {
+	case COND_NOT:
+		return !in_state_test(state, cond->args[0]->bit);
+	case COND_AND:
+		for (i = 0; i < cond->n_args; i++)
+			if (!in_state_test(state, cond->args[i]->bit))
+				return false;
+		return true;
+	case COND_OR:
+		for (i = 0; i < cond->n_args; i++)
+			if (in_state_test(state, cond->args[i]->bit))
+				return true;
+		return false;
+	default:
+		return in_state_test(state, cond->bit);
+	}
+}
+
+static void cond_queue(struct cond *cond)
+{
+	struct cond **conds;
+
+	if (cond->queued)
+		return;
+
+	if (cond->depth >= g_cond_work_n) {
+		g_cond_work = reallocarray(g_cond_work, cond->depth + 1,
+					   sizeof(*g_cond_work));
+		assert(g_cond_work);
+
+		memset(&g_cond_work[g_cond_work_n], 0,
+		       (cond->depth + 1 - g_cond_work_n) * sizeof(*g_cond_work));
+		g_cond_work_n = cond->depth + 1;
+	}
+
+	conds = reallocarray(g_cond_work[cond->depth].conds,
+			     g_cond_work[cond->depth].n + 1, sizeof(*conds));
+	assert(conds);
+
+	conds[g_cond_work[cond->depth].n++] = cond;
+	g_cond_work[cond->depth].conds = conds;
+	cond->queued = true;
+}
+
+/* Called when the state of cond has flipped */
+void cond_changed(struct cond *cond)
+{
+	size_t i;
+
+	out_queue(cond);
+
+	for (i = 0; i < cond->n_parents; i++)
+		cond_queue(cond->parents[i]);
+}
+
+/* Reevaluate all queued conditions, in order of increasing depth,
+ * propagating any flips to their parents. */
+void cond_update(void)
+{
+	const uint64_t *state = in_state();
+	struct cond *cond;
+	size_t d, i;
+	bool val;
+
+	for (d = 0; d < g_cond_work_n; d++) {
+		for (i = 0; i < g_cond_work[d].n; i++) {
+			cond = g_cond_work[d].conds[i];
+			cond->queued = false;
+
+			val = cond_eval(cond, state);
+			if (val == in_state_test(state, cond->bit))
+				continue;
+
+			in_state_set(cond->bit, val);
+			cond_changed(cond);
+		}
+
+		g_cond_work[d].n = 0;
+	}
+}
+
+/* Evaluate all compound conditions from scratch */
+void cond_refresh(void)
+{
+	const uint64_t *state = in_state();
+	size_t i;
+
+	for (i = 0; i < g_cond_list_n; i++)
+		in_state_set(g_cond_list[i]->bit, cond_eval(g_cond_list[i], state));
+}
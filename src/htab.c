@@ -0,0 +1,93 @@
+#include <stdlib.h>
+
+#include "iito.h"
+
+#define HTAB_MIN_BKTS 16
+
+static uint32_t htab_hash(const char *key)
+{
+	uint32_t h = 2166136261;
+
+	for (; *key; key++) {
+		h ^= (unsigned char)*key;
+		h *= 16777619;
+	}
+
+	return h;
+}
+
+static void htab_grow(struct htab *htab)
+{
+	struct hnode **bkts, ***tails, *hn, *next;
+	size_t i, n_bkts;
+
+	n_bkts = htab->n_bkts ? htab->n_bkts << 1 : HTAB_MIN_BKTS;
+
+	bkts = calloc(n_bkts, sizeof(*bkts));
+	tails = calloc(n_bkts, sizeof(*tails));
+	assert(bkts && tails);
+
+	for (i = 0; i < n_bkts; i++)
+		tails[i] = &bkts[i];
+
+	/* Preserve the relative order of the nodes in each chain */
+	for (i = 0; i < htab->n_bkts; i++) {
+		for (hn = htab->bkts[i]; hn; hn = next) {
+			next = hn->next;
+			hn->next = NULL;
+
+			*tails[hn->hash & (n_bkts - 1)] = hn;
+			tails[hn->hash & (n_bkts - 1)] = &hn->next;
+		}
+	}
+
+	free(tails);
+	free(htab->bkts);
+	htab->bkts = bkts;
+	htab->n_bkts = n_bkts;
+}
+
+void htab_add(struct htab *htab, struct hnode *hn, const char *key)
+{
+	struct hnode **bkt;
+
+	if (htab->n >= htab->n_bkts)
+		htab_grow(htab);
+
+	hn->key = key;
+	hn->hash = htab_hash(key);
+
+	/* Append, so that nodes sharing a key are visited in the
+	 * order in which they were added. */
+	for (bkt = &htab->bkts[hn->hash & (htab->n_bkts - 1)]; *bkt;
+	     bkt = &(*bkt)->next);
+
+	hn->next = NULL;
+	*bkt = hn;
+	htab->n++;
+}
+
+static struct hnode *htab_scan(struct hnode *hn, uint32_t hash, const char *key)
+{
+	for (; hn; hn = hn->next)
+		if (hn->hash == hash && !strcmp(hn->key, key))
+			return hn;
+
+	return NULL;
+}
+
+struct hnode *htab_find(const struct htab *htab, const char *key)
+{
+	uint32_t hash;
+
+	if (!htab->n)
+		return NULL;
+
+	hash = htab_hash(key);
+	return htab_scan(htab->bkts[hash & (htab->n_bkts - 1)], hash, key);
+}
+
+struct hnode *htab_find_next(const struct hnode *hn)
+{
+	return htab_scan(hn->next, hn->hash, hn->key);
+}
@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
@@ -41,6 +42,57 @@
 #define odev_dbg(_dev, _fmt, ...) log_dbg("(out) %s: " _fmt, (_dev)->name, ##__VA_ARGS__)
 
 
+/* htab */
+
+struct hnode {
+	struct hnode *next;
+	const char *key;
+	uint32_t hash;
+};
+
+struct htab {
+	struct hnode **bkts;
+	size_t n_bkts;
+	size_t n;
+};
+
+void htab_add(struct htab *htab, struct hnode *hn, const char *key);
+struct hnode *htab_find(const struct htab *htab, const char *key);
+struct hnode *htab_find_next(const struct hnode *hn);
+
+#define htab_foreach_key(_htab, _key, _hn)				\
+	for (_hn = htab_find(_htab, _key); _hn; _hn = htab_find_next(_hn))
+
+#define htab_foreach(_htab, _i, _hn)					\
+	for (_i = 0; _i < (_htab)->n_bkts; _i++)			\
+		for (_hn = (_htab)->bkts[_i]; _hn; _hn = _hn->next)
+
+
+/* arena */
+
+void *arena_alloc(size_t size);
+void *arena_allocarray(size_t n, size_t size);
+const char *arena_strdup(const char *str);
+void arena_log(void);
+
+
+/* pwatch */
+
+/* Tracks the existence of a path, calling cb whenever it changes. If
+ * modify holds any inotify events, e.g. IN_CLOSE_WRITE, cb is also
+ * called when they occur, or when the file is replaced. */
+struct pwatch {
+	const char *path;
+	void (*cb)(struct pwatch *pw);
+	uint32_t modify;
+	bool present;
+
+	struct hnode node;
+};
+
+int pwatch_add(struct pwatch *pw);
+
+
 /* uddev */
 
 struct uddev;
@@ -52,28 +104,74 @@ struct uddev {
 	const char *sysname;
 	uddev_cb_t cb;
 
-	struct ev_io ev;
-	struct udev *ud;
-	struct udev_monitor *mon;
+	/* Optional. Called when dev has been replaced by a rescan of
+	 * all devices, after events have been lost. */
+	void (*sync)(struct uddev *uddev);
+
+	struct hnode node;
 	struct udev_device *dev;
+	bool stale;
 };
 
 bool uddev_present(struct uddev *uddev);
-int uddev_set_sysfs(struct uddev *uddev, const char *attr, const char *fmt, ...);
 
 int uddev_start(struct uddev *uddev);
 int uddev_init(struct uddev *uddev);
 
+int uddev_enum_match(const char *subsys, const char **patterns, size_t n_patterns,
+		     const char ***sysnamesp, size_t *np);
+void uddev_enum_done(void);
+
+void uddev_kfilter(bool enable);
+void uddev_dump(void);
+
 
 /* input */
 
+/* A property of an input that is referenced by some rule. Its state
+ * is kept in a global bit vector, at position bit, and is only
+ * sampled when the input reports a change. */
+struct in_prop {
+	struct in_prop *next;
+
+	struct in_dev *idev;
+	const char *name;
+	unsigned int bit;
+
+	struct cond *cond;
+};
+
 struct in_dev {
 	const char *name;
 
 	int (*sample)(struct in_dev *dev, const char *prop, bool *state);
+
+	struct in_prop *props;
+	struct hnode node;
+
+	/* Changes are collected in a dirty set, which is processed
+	 * once per loop iteration. Inputs with a coalescing window
+	 * are only marked dirty once it has elapsed, absorbing any
+	 * further changes made in the meantime. */
+	bool dirty;
+	ev_tstamp coalesce;
+	struct ev_timer coalesce_timer;
 };
 
 void in_dev_add(struct in_dev *idev);
+void in_dev_changed(struct in_dev *idev);
+int in_flush(void);
+void in_flush_schedule(void);
+int in_refresh(void);
+
+const uint64_t *in_state(void);
+unsigned int in_state_alloc(void);
+void in_state_set(unsigned int bit, bool state);
+
+static inline bool in_state_test(const uint64_t *state, unsigned int bit)
+{
+	return (state[bit >> 6] >> (bit & 63)) & 1;
+}
 
 struct in_drv {
 	const char *name;
@@ -82,15 +180,69 @@ struct in_drv {
 
 int in_probe(json_t *ins);
 
-int in_dev_find(const char *nameprop, struct in_dev **idevp, const char **propp);
+int in_prop_find(const char *nameprop, struct in_prop **ipropp);
+
+
+/* cond */
+
+struct out_dev;
+
+enum cond_op {
+	COND_PROP,
+	COND_NOT,
+	COND_AND,
+	COND_OR,
+};
+
+/* An output whose rules reference a condition, along with the
+ * position of the first such rule. */
+struct cond_use {
+	struct out_dev *odev;
+	size_t rule;
+};
+
+/* A node in the condition DAG. Either a leaf, referring to an input
+ * property, or an operation on its args. The node's state is kept in
+ * the input state vector at position bit. */
+struct cond {
+	enum cond_op op;
+	struct in_prop *iprop;
+	struct cond **args;
+	size_t n_args;
+
+	unsigned int bit;
+	unsigned int depth;
+	bool queued;
+
+	struct hnode node;
+
+	struct cond **parents;
+	size_t n_parents;
+
+	struct cond_use *uses;
+	size_t n_uses;
+};
+
+static inline const char *cond_expr(const struct cond *cond)
+{
+	return cond->node.key;
+}
+
+int cond_parse(const char *expr, struct cond **condp, bool *invertp);
+
+void cond_changed(struct cond *cond);
+void cond_update(void);
+void cond_refresh(void);
 
 
 /* output */
 
 struct out_rule {
 	bool invert;
-	struct in_dev *idev;
-	const char *prop;
+	struct cond *cond;
+
+	/* The rule's "then" object. Drivers must compile it into priv
+	 * while probing, it is released along with the config. */
 	json_t *state;
 	void *priv;
 };
@@ -100,15 +252,31 @@ struct out_dev {
 	struct out_rule *rules;
 	size_t n_rules;
 
+	/* Rules compiled to one state bit per rule, along with a mask
+	 * of the inverted ones. */
+	unsigned int *rbits;
+	uint64_t *rinv;
+
 	struct out_rule *active_rule;
+	struct out_rule *pending_rule;
 	int (*apply)(struct out_dev *odev, struct out_rule *rule);
+
+	/* The active rule may not have been applied, e.g. because a
+	 * deferred write failed, and is to be reapplied on the next
+	 * update. */
+	bool retry;
+
+	bool queued;
 };
 
 void out_dump(void);
 
-int out_update(const struct in_dev *filter);
+void out_queue(struct cond *cond);
+int out_flush(void);
+int out_update(void);
 
 void out_dev_add(struct out_dev *odev);
+void out_dev_retry(struct out_dev *odev);
 
 struct out_drv {
 	const char *name;
@@ -0,0 +1,143 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "iito.h"
+
+#define _PATH_CGROUP "/sys/fs/cgroup"
+
+/* Tracks a cgroup v2 through its cgroup.events file, which the kernel
+ * modifies whenever any of its keys change. The cgroup need not exist,
+ * e.g. a service that is not yet started. */
+struct in_cgroup {
+	struct in_dev dev;
+	struct pwatch pw;
+
+	bool populated;
+	bool frozen;
+};
+
+static void in_cgroup_parse(struct in_cgroup *icg, char *buf)
+{
+	char *line, *val;
+
+	for (line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+		val = strchr(line, ' ');
+		if (!val)
+			continue;
+
+		*val++ = '\0';
+
+		if (!strcmp(line, "populated"))
+			icg->populated = (*val == '1');
+		else if (!strcmp(line, "frozen"))
+			icg->frozen = (*val == '1');
+	}
+}
+
+static void in_cgroup_read(struct in_cgroup *icg)
+{
+	char buf[0x100];
+	ssize_t len;
+	int fd;
+
+	icg->populated = false;
+	icg->frozen = false;
+
+	if (!icg->pw.present)
+		return;
+
+	fd = open(icg->pw.path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			idev_err(&icg->dev, "Unable to open \"%s\" (%d)",
+				 icg->pw.path, -errno);
+		return;
+	}
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0) {
+		idev_err(&icg->dev, "Unable to read \"%s\" (%d)",
+			 icg->pw.path, -errno);
+		return;
+	}
+
+	buf[len] = '\0';
+	in_cgroup_parse(icg, buf);
+}
+
+static void in_cgroup_cb(struct pwatch *pw)
+{
+	struct in_cgroup *icg = container_of(pw, struct in_cgroup, pw);
+	bool populated = icg->populated, frozen = icg->frozen;
+
+	in_cgroup_read(icg);
+
+	if (populated != icg->populated || frozen != icg->frozen)
+		in_dev_changed(&icg->dev);
+}
+
+static int in_cgroup_sample(struct in_dev *dev, const char *prop, bool *state)
+{
+	struct in_cgroup *icg = container_of(dev, struct in_cgroup, dev);
+
+	if (!prop || !strcmp(prop, "populated")) {
+		*state = icg->populated;
+		return 0;
+	}
+
+	if (!strcmp(prop, "frozen")) {
+		*state = icg->frozen;
+		return 0;
+	}
+
+	idev_err(&icg->dev, "Unable to sample unknown property \"%s\"", prop);
+	return -EINVAL;
+}
+
+static int in_cgroup_probe(const char *name, json_t *data)
+{
+	struct in_cgroup *icg;
+	const char *cgroup;
+	char *path;
+	int err;
+
+	icg = arena_alloc(sizeof(*icg));
+
+	icg->dev.name = name;
+	icg->dev.sample = in_cgroup_sample;
+
+	err = json_unpack(data, "{s:s}", "path", &cgroup);
+	if (err)
+		cgroup = name;
+
+	/* Relative to the root of the unified hierarchy, like in
+	 * /proc/<pid>/cgroup, with or without a leading slash */
+	if (asprintf(&path, _PATH_CGROUP "/%s/cgroup.events", cgroup) < 0)
+		return -ENOMEM;
+
+	in_dev_add(&icg->dev);
+
+	/* kernfs does not close the file, it only reports it as
+	 * modified */
+	icg->pw.path = path;
+	icg->pw.cb = in_cgroup_cb;
+	icg->pw.modify = IN_MODIFY;
+
+	err = pwatch_add(&icg->pw);
+	free(path);
+	if (err) {
+		idev_err(&icg->dev, "Unable to watch \"%s\" (%d)", cgroup, err);
+		return err;
+	}
+
+	in_cgroup_read(icg);
+	return 0;
+}
+
+const struct in_drv in_cgroup = {
+	.name = "cgroup",
+	.probe = in_cgroup_probe,
+};
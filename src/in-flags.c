@@ -0,0 +1,264 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "iito.h"
+
+/* A flag that is referenced by some rule */
+struct in_flags_key {
+	struct hnode node;
+	bool state;
+	bool seen;
+};
+
+/* Many boolean inputs, read from a single file of "key=value" lines,
+ * such that producers can change any number of them with one atomic
+ * rename. Only keys referenced by rules are tracked, the rest of the
+ * file is skipped while parsing. */
+struct in_flags {
+	struct in_dev dev;
+	struct pwatch pw;
+
+	struct htab keys;
+	bool indexed;
+	bool present;
+
+	char *buf;
+	size_t size;
+};
+
+static int in_flags_value(const char *val, bool *state)
+{
+	static const char *truths[] = { "1", "true", "yes", "on", "y", NULL };
+	static const char *lies[] = { "0", "false", "no", "off", "n", "", NULL };
+	const char **s;
+
+	for (s = truths; *s; s++) {
+		if (!strcasecmp(*s, val)) {
+			*state = true;
+			return 0;
+		}
+	}
+
+	for (s = lies; *s; s++) {
+		if (!strcasecmp(*s, val)) {
+			*state = false;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static char *in_flags_trim(char *str, char *end)
+{
+	while (str < end && (*str == ' ' || *str == '\t'))
+		str++;
+
+	while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+		end--;
+
+	*end = '\0';
+	return str;
+}
+
+static ssize_t in_flags_read(struct in_flags *ifl)
+{
+	size_t len = 0;
+	int fd, err = 0;
+	ssize_t n;
+	char *buf;
+
+	fd = open(ifl->pw.path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return (errno == ENOENT) ? 0 : -errno;
+
+	for (;;) {
+		if (len + 1 >= ifl->size) {
+			buf = realloc(ifl->buf, ifl->size ? ifl->size << 1 : 0x1000);
+			assert(buf);
+
+			ifl->size = ifl->size ? ifl->size << 1 : 0x1000;
+			ifl->buf = buf;
+		}
+
+		n = read(fd, &ifl->buf[len], ifl->size - len - 1);
+		if (n < 0)
+			err = -errno;
+		if (n <= 0)
+			break;
+
+		len += n;
+	}
+
+	close(fd);
+	if (err)
+		return err;
+
+	ifl->buf[len] = '\0';
+	return len;
+}
+
+/* Parse the file, line by line, into the referenced keys. Returns
+ * true if any of them changed state. */
+static bool in_flags_load(struct in_flags *ifl)
+{
+	char *line, *next, *eq, *key, *val;
+	struct in_flags_key *fk;
+	bool changed = false;
+	struct hnode *hn;
+	ssize_t len;
+	bool state;
+	size_t i;
+
+	len = in_flags_read(ifl);
+	if (len < 0) {
+		idev_err(&ifl->dev, "Unable to read \"%s\" (%zd)", ifl->pw.path, len);
+		len = 0;
+	}
+
+	htab_foreach(&ifl->keys, i, hn)
+		container_of(hn, struct in_flags_key, node)->seen = false;
+
+	for (line = ifl->buf; len && *line; line = next) {
+		next = strchrnul(line, '\n');
+		if (*next)
+			*next++ = '\0';
+
+		eq = strchrnul(line, '=');
+		val = *eq ? eq + 1 : NULL;
+
+		key = in_flags_trim(line, eq);
+		if (!*key || *key == '#')
+			continue;
+
+		hn = htab_find(&ifl->keys, key);
+		if (!hn)
+			continue;
+
+		fk = container_of(hn, struct in_flags_key, node);
+
+		/* A bare key is set */
+		state = true;
+		if (val) {
+			val = in_flags_trim(val, val + strlen(val));
+
+			if (in_flags_value(val, &state)) {
+				idev_wrn(&ifl->dev, "Invalid value \"%s\" of \"%s\"",
+					 val, key);
+				state = false;
+			}
+		}
+
+		changed |= fk->state != state;
+		fk->state = state;
+		fk->seen = true;
+	}
+
+	/* Keys that are not in the file are cleared */
+	htab_foreach(&ifl->keys, i, hn) {
+		fk = container_of(hn, struct in_flags_key, node);
+		if (fk->seen)
+			continue;
+
+		changed |= fk->state;
+		fk->state = false;
+	}
+
+	return changed;
+}
+
+/* Rules are parsed after inputs have been probed, so the set of
+ * referenced keys is only known on the first sample. */
+static void in_flags_index(struct in_flags *ifl)
+{
+	struct in_flags_key *fk;
+	struct in_prop *iprop;
+
+	for (iprop = ifl->dev.props; iprop; iprop = iprop->next) {
+		if (!iprop->name)
+			continue;
+
+		fk = arena_alloc(sizeof(*fk));
+		htab_add(&ifl->keys, &fk->node, iprop->name);
+	}
+
+	ifl->indexed = true;
+	ifl->present = ifl->pw.present;
+	in_flags_load(ifl);
+}
+
+static void in_flags_cb(struct pwatch *pw)
+{
+	struct in_flags *ifl = container_of(pw, struct in_flags, pw);
+
+	if (!ifl->indexed)
+		return;
+
+	/* Many flags may have changed, but they are reported as one
+	 * change of the input, and only if any referenced flag, or the
+	 * existence of the file, has actually changed. */
+	if (in_flags_load(ifl) || ifl->present != pw->present) {
+		ifl->present = pw->present;
+		in_dev_changed(&ifl->dev);
+	}
+}
+
+static int in_flags_sample(struct in_dev *dev, const char *prop, bool *state)
+{
+	struct in_flags *ifl = container_of(dev, struct in_flags, dev);
+	struct hnode *hn;
+
+	if (!ifl->indexed)
+		in_flags_index(ifl);
+
+	if (!prop) {
+		*state = ifl->pw.present;
+		return 0;
+	}
+
+	hn = htab_find(&ifl->keys, prop);
+	if (!hn) {
+		idev_err(&ifl->dev, "Unable to sample unknown flag \"%s\"", prop);
+		return -EINVAL;
+	}
+
+	*state = container_of(hn, struct in_flags_key, node)->state;
+	return 0;
+}
+
+static int in_flags_probe(const char *name, json_t *data)
+{
+	struct in_flags *ifl;
+	const char *path;
+	int err;
+
+	ifl = arena_alloc(sizeof(*ifl));
+
+	ifl->dev.name = name;
+	ifl->dev.sample = in_flags_sample;
+
+	err = json_unpack(data, "{s:s}", "path", &path);
+	if (err)
+		path = name;
+
+	in_dev_add(&ifl->dev);
+
+	ifl->pw.path = path;
+	ifl->pw.cb = in_flags_cb;
+	ifl->pw.modify = IN_CLOSE_WRITE;
+
+	err = pwatch_add(&ifl->pw);
+	if (err) {
+		idev_err(&ifl->dev, "Unable to watch \"%s\" (%d)", path, err);
+		return err;
+	}
+
+	return 0;
+}
+
+const struct in_drv in_flags = {
+	.name = "flags",
+	.probe = in_flags_probe,
+};
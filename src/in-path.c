@@ -3,14 +3,14 @@
 
 struct in_path {
 	struct in_dev dev;
-	struct ev_stat stat;
+	struct pwatch pw;
 };
 
-static void in_path_cb(struct ev_loop *loop, struct ev_stat *w, int revents)
+static void in_path_cb(struct pwatch *pw)
 {
-	struct in_path *ip = container_of(w, struct in_path, stat);
+	struct in_path *ip = container_of(pw, struct in_path, pw);
 
-	out_update(&ip->dev);
+	in_dev_changed(&ip->dev);
 }
 
 static int in_path_sample(struct in_dev *dev, const char *prop, bool *state)
@@ -18,12 +18,12 @@ static int in_path_sample(struct in_dev *dev, const char *prop, bool *state)
 	struct in_path *ip = container_of(dev, struct in_path, dev);
 
 	if (!prop || !strcmp(prop, "present")) {
-		*state = !!ip->stat.attr.st_nlink;
+		*state = ip->pw.present;
 		return 0;
 	}
 
 	if (!strcmp(prop, "absent")) {
-		*state = !ip->stat.attr.st_nlink;
+		*state = !ip->pw.present;
 		return 0;
 	}
 
@@ -37,8 +37,7 @@ static int in_path_probe(const char *name, json_t *data)
 	const char *path;
 	int err;
 
-	ip = calloc(1, sizeof(*ip));
-	assert(ip);
+	ip = arena_alloc(sizeof(*ip));
 
 	ip->dev.name = name;
 	ip->dev.sample = in_path_sample;
@@ -49,8 +48,15 @@ static int in_path_probe(const char *name, json_t *data)
 
 	in_dev_add(&ip->dev);
 
-	ev_stat_init(&ip->stat, in_path_cb, path, 0.);
-	ev_stat_start(ev_default_loop(0), &ip->stat);
+	ip->pw.path = path;
+	ip->pw.cb = in_path_cb;
+
+	err = pwatch_add(&ip->pw);
+	if (err) {
+		idev_err(&ip->dev, "Unable to watch \"%s\" (%d)", path, err);
+		return err;
+	}
+
 	return 0;
 }
 
@@ -0,0 +1,267 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+
+#include "iito.h"
+
+/* Not defined by older C libraries. The number is shared by all
+ * architectures, except for alpha, which is offset from its own
+ * syscall table. */
+#ifndef SYS_pidfd_open
+# ifdef __alpha__
+#  define SYS_pidfd_open 544
+# else
+#  define SYS_pidfd_open 434
+# endif
+#endif
+
+/* Tracks whether a process is running. The process is found through
+ * its pidfile or, failing that, its name, and is then held by a
+ * pidfd, which becomes readable when it exits.
+ *
+ * Kernels older than 5.3 have no pidfds. The process is then only
+ * checked for when the pidfile is written, and is assumed to have
+ * exited when the pidfile is removed. */
+struct in_pid {
+	struct in_dev dev;
+	struct pwatch pw;
+	const char *comm;
+
+	pid_t pid;
+	struct ev_io io;
+	bool alive;
+};
+
+static bool g_in_pid_nosys;
+
+static int in_pid_pidfd_open(pid_t pid)
+{
+	return syscall(SYS_pidfd_open, pid, 0);
+}
+
+static pid_t in_pid_read_pidfile(struct in_pid *ip)
+{
+	char buf[16];
+	ssize_t len;
+	long pid;
+	int fd;
+
+	fd = open(ip->pw.path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+
+	buf[len] = '\0';
+
+	errno = 0;
+	pid = strtol(buf, NULL, 10);
+	if (errno || pid <= 0 || pid > INT_MAX)
+		return 0;
+
+	return pid;
+}
+
+static pid_t in_pid_find_comm(struct in_pid *ip)
+{
+	char path[32], comm[32];
+	struct dirent *ent;
+	pid_t pid = 0;
+	ssize_t len;
+	DIR *proc;
+	int fd;
+
+	proc = opendir("/proc");
+	if (!proc)
+		return 0;
+
+	while (!pid && (ent = readdir(proc))) {
+		if (!isdigit(ent->d_name[0]))
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%s/comm", ent->d_name);
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		len = read(fd, comm, sizeof(comm) - 1);
+		close(fd);
+		if (len <= 0)
+			continue;
+
+		comm[len] = '\0';
+		comm[strcspn(comm, "\n")] = '\0';
+
+		if (!strcmp(comm, ip->comm))
+			pid = atoi(ent->d_name);
+	}
+
+	closedir(proc);
+	return pid;
+}
+
+static bool in_pid_running(struct in_pid *ip)
+{
+	return ev_is_active(&ip->io) || ip->alive;
+}
+
+static void in_pid_release(struct in_pid *ip)
+{
+	ip->alive = false;
+
+	if (!ev_is_active(&ip->io))
+		return;
+
+	ev_io_stop(ev_default_loop(0), &ip->io);
+	close(ip->io.fd);
+}
+
+static void in_pid_io_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+	struct in_pid *ip = container_of(w, struct in_pid, io);
+
+	idev_dbg(&ip->dev, "Process %d exited", ip->pid);
+
+	in_pid_release(ip);
+	in_dev_changed(&ip->dev);
+}
+
+/* Hold on to the process, if it is running, until it exits */
+static void in_pid_track(struct in_pid *ip, pid_t pid)
+{
+	int fd;
+
+	if (!pid || (pid == ip->pid && ev_is_active(&ip->io)))
+		return;
+
+	in_pid_release(ip);
+	ip->pid = pid;
+
+	if (!g_in_pid_nosys) {
+		fd = in_pid_pidfd_open(pid);
+		if (fd >= 0) {
+			idev_dbg(&ip->dev, "Tracking process %d", pid);
+
+			ev_io_init(&ip->io, in_pid_io_cb, fd, EV_READ);
+			ev_io_start(ev_default_loop(0), &ip->io);
+			return;
+		}
+
+		if (errno != ENOSYS) {
+			if (errno != ESRCH)
+				idev_err(&ip->dev, "Unable to open process %d (%d)",
+					 pid, -errno);
+			return;
+		}
+
+		log_wrn("(pid) pidfds are not supported by the kernel, process "
+			"exits are only noticed through their pidfiles");
+		g_in_pid_nosys = true;
+	}
+
+	ip->alive = !kill(pid, 0) || errno == EPERM;
+	idev_dbg(&ip->dev, "Process %d is %s", pid,
+		 ip->alive ? "running" : "not running");
+}
+
+static pid_t in_pid_find(struct in_pid *ip)
+{
+	pid_t pid;
+
+	pid = in_pid_read_pidfile(ip);
+	if (!pid && ip->comm)
+		pid = in_pid_find_comm(ip);
+
+	return pid;
+}
+
+/* The pidfile has been (re)written, or removed. The latter does not
+ * affect a process that is held by a pidfd. */
+static void in_pid_pw_cb(struct pwatch *pw)
+{
+	struct in_pid *ip = container_of(pw, struct in_pid, pw);
+	bool running = in_pid_running(ip);
+
+	if (pw->present)
+		in_pid_track(ip, in_pid_read_pidfile(ip));
+	else
+		ip->alive = false;
+
+	if (running != in_pid_running(ip))
+		in_dev_changed(&ip->dev);
+}
+
+static int in_pid_sample(struct in_dev *dev, const char *prop, bool *state)
+{
+	struct in_pid *ip = container_of(dev, struct in_pid, dev);
+
+	if (!prop || !strcmp(prop, "running")) {
+		*state = in_pid_running(ip);
+		return 0;
+	}
+
+	if (!strcmp(prop, "stopped")) {
+		*state = !in_pid_running(ip);
+		return 0;
+	}
+
+	idev_err(&ip->dev, "Unable to sample unknown property \"%s\"", prop);
+	return -EINVAL;
+}
+
+static int in_pid_probe(const char *name, json_t *data)
+{
+	const char *pidfile = NULL, *comm = NULL;
+	struct in_pid *ip;
+	char *path;
+	int err;
+
+	ip = arena_alloc(sizeof(*ip));
+
+	ip->dev.name = name;
+	ip->dev.sample = in_pid_sample;
+
+	if (json_unpack(data, "{s?s s?s}", "pidfile", &pidfile, "comm", &comm)) {
+		idev_err(&ip->dev, "\"pidfile\" and \"comm\" must be strings");
+		return -EINVAL;
+	}
+
+	if (comm)
+		ip->comm = arena_strdup(comm);
+
+	if (!pidfile) {
+		if (asprintf(&path, "/run/%s.pid", name) < 0)
+			return -ENOMEM;
+
+		pidfile = arena_strdup(path);
+		free(path);
+	}
+
+	in_dev_add(&ip->dev);
+
+	ip->pw.path = pidfile;
+	ip->pw.cb = in_pid_pw_cb;
+	ip->pw.modify = IN_CLOSE_WRITE;
+
+	err = pwatch_add(&ip->pw);
+	if (err) {
+		idev_err(&ip->dev, "Unable to watch \"%s\" (%d)", pidfile, err);
+		return err;
+	}
+
+	in_pid_track(ip, in_pid_find(ip));
+	return 0;
+}
+
+const struct in_drv in_pid = {
+	.name = "pid",
+	.probe = in_pid_probe,
+};
@@ -0,0 +1,521 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "iito.h"
+
+/* A named property that is set when the value crosses on, and
+ * cleared when it crosses back over off. If on is below off, the
+ * property is set when the value falls instead. */
+struct in_sysfs_thresh {
+	const char *name;
+	long long on;
+	long long off;
+	bool state;
+};
+
+/* Tracks the value of a sysfs attribute. Either the kernel signals
+ * changes with sysfs_notify(), e.g. an hwmon alarm or a GPIO with an
+ * edge set, or the attribute is sampled periodically, e.g. a
+ * temperature. Notified changes are not accompanied by a uevent.
+ * Instead, polling the open attribute reports POLLPRI|POLLERR, after
+ * which it must be reread from the start to rearm.
+ *
+ * Attributes come and go with their devices. While absent, the value
+ * is empty. As sysfs does not report new files to inotify, attributes
+ * of a device that is named in the path are reopened on its uevents,
+ * sampled ones are also retried on every sample. */
+struct in_sysfs {
+	struct in_dev dev;
+	struct pwatch pw;
+	struct uddev uddev;
+	int fd;
+
+	/* The last read error, of an attribute that is still present */
+	int err;
+
+	/* The value, and its parsed form if it is a number */
+	char val[0x80];
+	bool numeric;
+	long long num;
+	bool truth;
+
+	struct in_sysfs_thresh *thresh;
+	size_t n_thresh;
+
+	/* Whether any rule compares the value as a string, in which
+	 * case every change must be reported. Known from the first
+	 * sample. */
+	bool indexed;
+	bool exact;
+
+	/* Sampling interval of attributes that are not notified, and
+	 * their next deadline, in milliseconds */
+	long long interval;
+	long long due;
+};
+
+/* libev only waits for readability, so all attributes are polled for
+ * priority events by a single epoll instance, which is readable
+ * whenever any of them has been notified.
+ *
+ * Attributes without notifications share a single timer, which reads
+ * all that are due in one pass. Deadlines are aligned to multiples of
+ * their interval, such that attributes with the same, or a multiple
+ * of the same, interval are read together. They are kept on the
+ * monotonic clock, which libev's timers also run on, rather than on
+ * ev_now(), which follows the wall clock, and would stall sampling
+ * when it is set back. */
+static struct {
+	int epfd;
+	struct ev_io io;
+
+	struct in_sysfs **polled;
+	size_t n_polled;
+	struct ev_timer timer;
+} g_in_sysfs = {
+	.epfd = -1,
+};
+
+static bool in_sysfs_thresh_update(struct in_sysfs_thresh *t, long long num)
+{
+	bool state = t->state;
+
+	if (t->on >= t->off) {
+		if (num >= t->on)
+			state = true;
+		else if (num < t->off)
+			state = false;
+	} else {
+		if (num <= t->on)
+			state = true;
+		else if (num > t->off)
+			state = false;
+	}
+
+	if (state == t->state)
+		return false;
+
+	t->state = state;
+	return true;
+}
+
+static int in_sysfs_open(struct in_sysfs *is)
+{
+	struct epoll_event ev = {
+		.events = EPOLLPRI | EPOLLERR,
+		.data.ptr = is,
+	};
+	int err;
+
+	is->fd = open(is->pw.path, O_RDONLY | O_CLOEXEC);
+	if (is->fd < 0)
+		return -errno;
+
+	if (!is->interval && epoll_ctl(g_in_sysfs.epfd, EPOLL_CTL_ADD, is->fd, &ev)) {
+		err = -errno;
+		close(is->fd);
+		is->fd = -1;
+		return err;
+	}
+
+	return 0;
+}
+
+/* Stop polling an attribute that has gone away, as its fd would
+ * otherwise be reported as notified, and fail to read, forever. */
+static void in_sysfs_close(struct in_sysfs *is)
+{
+	if (is->fd < 0)
+		return;
+
+	if (!is->interval)
+		epoll_ctl(g_in_sysfs.epfd, EPOLL_CTL_DEL, is->fd, NULL);
+
+	close(is->fd);
+	is->fd = -1;
+}
+
+/* Reread the attribute, which also rearms the notification. Returns
+ * true if any property may have changed. */
+static bool in_sysfs_read(struct in_sysfs *is)
+{
+	char buf[sizeof(is->val)], *end;
+	bool truth, changed = false;
+	ssize_t len = -1;
+	size_t i;
+
+	if (is->fd >= 0) {
+		len = pread(is->fd, buf, sizeof(buf) - 1, 0);
+		if (len < 0 && errno != ENODEV && errno != ENOENT) {
+			/* Attributes may fail to read while they are
+			 * present, e.g. the carrier of a link that is
+			 * down, or an hwmon sensor behind a failing bus.
+			 * The read still rearms the notification. */
+			if (is->err != -errno)
+				idev_dbg(&is->dev, "Unable to read \"%s\" (%d), "
+					 "keeping last value", is->pw.path, -errno);
+
+			is->err = -errno;
+			return false;
+		}
+
+		is->err = 0;
+
+		if (len < 0) {
+			idev_inf(&is->dev, "Lost \"%s\"", is->pw.path);
+			in_sysfs_close(is);
+		}
+	}
+
+	/* Absent attributes are empty, and clear all thresholds */
+	if (len < 0) {
+		for (i = 0; i < is->n_thresh; i++) {
+			changed |= is->thresh[i].state;
+			is->thresh[i].state = false;
+		}
+
+		len = 0;
+	}
+
+	while (len && (buf[len - 1] == '\n' || buf[len - 1] == ' '))
+		len--;
+
+	buf[len] = '\0';
+
+	if (!strcmp(buf, is->val))
+		return changed;
+
+	strcpy(is->val, buf);
+
+	/* Parsed once per change, no matter how many properties are
+	 * derived from it */
+	is->num = strtoll(is->val, &end, 10);
+	is->numeric = (end != is->val) && !*end;
+
+	truth = is->numeric ? !!is->num : !!is->val[0];
+	changed |= truth != is->truth;
+	is->truth = truth;
+
+	/* Thresholds keep their state while the value is not a number */
+	for (i = 0; is->numeric && i < is->n_thresh; i++)
+		changed |= in_sysfs_thresh_update(&is->thresh[i], is->num);
+
+	return changed || is->exact || !is->indexed;
+}
+
+/* Reread the attribute, first reopening it if it is absent, or has
+ * just gone away. */
+static void in_sysfs_update(struct in_sysfs *is)
+{
+	bool changed;
+
+	changed = in_sysfs_read(is);
+
+	if (is->fd < 0 && !in_sysfs_open(is)) {
+		idev_inf(&is->dev, "Found \"%s\"", is->pw.path);
+		changed |= in_sysfs_read(is);
+	}
+
+	if (changed) {
+		idev_dbg(&is->dev, "Changed to \"%s\"", is->val);
+		in_dev_changed(&is->dev);
+	}
+}
+
+static void in_sysfs_pw_cb(struct pwatch *pw)
+{
+	struct in_sysfs *is = container_of(pw, struct in_sysfs, pw);
+
+	/* An open regular file remains readable after it is removed */
+	if (!pw->present)
+		in_sysfs_close(is);
+
+	in_sysfs_update(is);
+}
+
+static void in_sysfs_uddev_cb(struct uddev *uddev, struct udev_device *dev)
+{
+	in_sysfs_update(container_of(uddev, struct in_sysfs, uddev));
+}
+
+static void in_sysfs_uddev_sync(struct uddev *uddev)
+{
+	in_sysfs_update(container_of(uddev, struct in_sysfs, uddev));
+}
+
+static void in_sysfs_io_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+	struct epoll_event evs[16];
+	int i, n;
+
+	/* Level triggered, anything that does not fit is picked up on
+	 * the next iteration. */
+	n = epoll_wait(g_in_sysfs.epfd, evs, 16, 0);
+	for (i = 0; i < n; i++)
+		in_sysfs_update(evs[i].data.ptr);
+}
+
+/* In whole milliseconds, such that deadlines that coincide compare
+ * equal. */
+static long long in_sysfs_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static long long in_sysfs_next_due(long long now, long long interval)
+{
+	return (now / interval + 1) * interval;
+}
+
+static void in_sysfs_schedule(struct ev_loop *loop)
+{
+	long long next = 0;
+	size_t i;
+
+	for (i = 0; i < g_in_sysfs.n_polled; i++)
+		if (!next || g_in_sysfs.polled[i]->due < next)
+			next = g_in_sysfs.polled[i]->due;
+
+	/* Relative timers count from the time of the loop iteration,
+	 * which lags behind by the time spent sampling */
+	ev_now_update(loop);
+
+	ev_timer_stop(loop, &g_in_sysfs.timer);
+	ev_timer_set(&g_in_sysfs.timer, (next - in_sysfs_now()) / 1000., 0.);
+	ev_timer_start(loop, &g_in_sysfs.timer);
+}
+
+static void in_sysfs_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	long long now = in_sysfs_now();
+	struct in_sysfs *is;
+	size_t i;
+
+	for (i = 0; i < g_in_sysfs.n_polled; i++) {
+		is = g_in_sysfs.polled[i];
+		if (is->due > now)
+			continue;
+
+		in_sysfs_update(is);
+		is->due = in_sysfs_next_due(now, is->interval);
+	}
+
+	in_sysfs_schedule(loop);
+}
+
+static int in_sysfs_init(void)
+{
+	g_in_sysfs.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (g_in_sysfs.epfd < 0) {
+		log_err("(sysfs) Unable to create epoll instance (%d)", -errno);
+		return -errno;
+	}
+
+	ev_io_init(&g_in_sysfs.io, in_sysfs_io_cb, g_in_sysfs.epfd, EV_READ);
+	ev_io_start(ev_default_loop(0), &g_in_sysfs.io);
+
+	ev_timer_init(&g_in_sysfs.timer, in_sysfs_timer_cb, 0., 0.);
+	return 0;
+}
+
+static void in_sysfs_poll(struct in_sysfs *is)
+{
+	struct ev_loop *loop = ev_default_loop(0);
+	struct in_sysfs **polled;
+
+	polled = reallocarray(g_in_sysfs.polled, g_in_sysfs.n_polled + 1,
+			      sizeof(*polled));
+	assert(polled);
+
+	polled[g_in_sysfs.n_polled++] = is;
+	g_in_sysfs.polled = polled;
+
+	is->due = in_sysfs_next_due(in_sysfs_now(), is->interval);
+	in_sysfs_schedule(loop);
+}
+
+/* Follow the uevents of the device that holds the attribute, if it is
+ * reached through its class or bus, e.g.
+ * /sys/class/hwmon/hwmon0/temp1_input. */
+static void in_sysfs_uddev_add(struct in_sysfs *is)
+{
+	char subsys[NAME_MAX + 1], sysname[NAME_MAX + 1];
+	int n = 0;
+
+	sscanf(is->pw.path, "/sys/class/%255[^/]/%255[^/]/%n", subsys, sysname, &n);
+	if (!n)
+		sscanf(is->pw.path, "/sys/bus/%255[^/]/devices/%255[^/]/%n",
+		       subsys, sysname, &n);
+	if (!n)
+		return;
+
+	is->uddev.subsys = arena_strdup(subsys);
+	is->uddev.sysname = arena_strdup(sysname);
+	is->uddev.cb = in_sysfs_uddev_cb;
+	is->uddev.sync = in_sysfs_uddev_sync;
+
+	/* Not fatal, the attribute is still tracked while it exists */
+	if (uddev_init(&is->uddev)) {
+		idev_wrn(&is->dev, "Unable to attach to udev, \"%s\" will not "
+			 "be reopened if its device is readded", is->pw.path);
+		return;
+	}
+
+	uddev_start(&is->uddev);
+}
+
+static struct in_sysfs_thresh *in_sysfs_thresh_find(struct in_sysfs *is,
+						    const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < is->n_thresh; i++)
+		if (!strcmp(is->thresh[i].name, name))
+			return &is->thresh[i];
+
+	return NULL;
+}
+
+static int in_sysfs_sample(struct in_dev *dev, const char *prop, bool *state)
+{
+	struct in_sysfs *is = container_of(dev, struct in_sysfs, dev);
+	struct in_sysfs_thresh *t;
+	struct in_prop *iprop;
+
+	if (!is->indexed) {
+		for (iprop = dev->props; iprop; iprop = iprop->next)
+			if (iprop->name && !in_sysfs_thresh_find(is, iprop->name))
+				is->exact = true;
+
+		is->indexed = true;
+	}
+
+	if (!prop) {
+		*state = is->truth;
+		return 0;
+	}
+
+	t = in_sysfs_thresh_find(is, prop);
+	if (t) {
+		*state = t->state;
+		return 0;
+	}
+
+	*state = !strcmp(is->val, prop);
+	return 0;
+}
+
+static int in_sysfs_thresh_parse(struct in_sysfs *is, json_t *threshs)
+{
+	struct in_sysfs_thresh *t;
+	json_int_t on, off;
+	const char *name;
+	json_t *val;
+
+	is->thresh = arena_allocarray(json_object_size(threshs), sizeof(*is->thresh));
+
+	json_object_foreach(threshs, name, val) {
+		if (json_is_integer(val)) {
+			on = off = json_integer_value(val);
+		} else if (!json_unpack(val, "{s:I}", "on", &on)) {
+			off = on;
+			if (json_unpack(val, "{s?I}", "off", &off))
+				goto err;
+		} else {
+			goto err;
+		}
+
+		t = &is->thresh[is->n_thresh++];
+		t->name = arena_strdup(name);
+		t->on = on;
+		t->off = off;
+	}
+
+	return 0;
+
+err:
+	idev_err(&is->dev, "Threshold \"%s\" must be a number, "
+		 "or an object with \"on\" and, optionally, \"off\"", name);
+	return -EINVAL;
+}
+
+static int in_sysfs_probe(const char *name, json_t *data)
+{
+	json_t *threshs = NULL;
+	struct in_sysfs *is;
+	json_int_t ms = 0;
+	const char *path;
+	int err;
+
+	if (g_in_sysfs.epfd < 0) {
+		err = in_sysfs_init();
+		if (err)
+			return err;
+	}
+
+	is = arena_alloc(sizeof(*is));
+
+	is->dev.name = name;
+	is->dev.sample = in_sysfs_sample;
+
+	if (json_unpack(data, "{s:s s?I s?o}", "path", &path,
+			"interval", &ms, "thresholds", &threshs) || ms < 0) {
+		idev_err(&is->dev, "\"path\" is required, and \"interval\" "
+			 "must be a non-negative number of milliseconds");
+		return -EINVAL;
+	}
+
+	if (threshs) {
+		err = in_sysfs_thresh_parse(is, threshs);
+		if (err)
+			return err;
+	}
+
+	is->interval = ms;
+
+	is->pw.path = path;
+	is->pw.cb = in_sysfs_pw_cb;
+
+	err = pwatch_add(&is->pw);
+	if (err) {
+		idev_err(&is->dev, "Unable to watch \"%s\" (%d)", path, err);
+		return err;
+	}
+
+	/* An attribute that does not exist yet, e.g. of a device whose
+	 * driver is not loaded, is absent until it appears */
+	err = in_sysfs_open(is);
+	if (err == -ENOENT || err == -ENODEV || err == -ENXIO) {
+		idev_inf(&is->dev, "\"%s\" is not available", is->pw.path);
+	} else if (err == -EPERM && !is->interval) {
+		/* epoll refuses files that do not support polling, such
+		 * as regular files */
+		idev_err(&is->dev, "\"%s\" does not support notifications, "
+			 "\"interval\" is required", is->pw.path);
+		return err;
+	} else if (err) {
+		idev_err(&is->dev, "Unable to open \"%s\" (%d)", is->pw.path, err);
+		return err;
+	}
+
+	/* Values within a hysteresis band start out cleared */
+	in_sysfs_read(is);
+
+	if (is->interval)
+		in_sysfs_poll(is);
+
+	in_sysfs_uddev_add(is);
+	in_dev_add(&is->dev);
+	return 0;
+}
+
+const struct in_drv in_sysfs = {
+	.name = "sysfs",
+	.probe = in_sysfs_probe,
+};
@@ -1,10 +1,45 @@
+#include <ctype.h>
+#include <stdlib.h>
+
 #include "iito.h"
 
+/* Properties are primarily read from the environment of the last
+ * uevent, e.g. POWER_SUPPLY_ONLINE, and only when the device does
+ * not provide one, from the corresponding sysfs attribute. Either
+ * way, the parsed value is cached until the next event arrives. */
+struct in_udev_prop {
+	const char *name;
+	const char *key;
+
+	bool valid;
+	bool state;
+};
+
+/* An explicit mapping of a property to a uevent key */
+struct in_udev_key {
+	const char *prop;
+	const char *key;
+};
+
 struct in_udev {
 	struct in_dev idev;
 	struct uddev uddev;
+
+	struct in_udev_key *keys;
+	size_t n_keys;
+
+	struct in_udev_prop *props;
+	size_t n_props;
 };
 
+static void in_udev_invalidate(struct in_udev *iu)
+{
+	size_t i;
+
+	for (i = 0; i < iu->n_props; i++)
+		iu->props[i].valid = false;
+}
+
 static void in_udev_uddev_cb(struct uddev *uddev, struct udev_device *dev)
 {
 	struct in_udev *iu = container_of(uddev, struct in_udev, uddev);
@@ -12,12 +47,83 @@ static void in_udev_uddev_cb(struct uddev *uddev, struct udev_device *dev)
 	udev_device_unref(uddev->dev);
 	uddev->dev = udev_device_ref(dev);
 
-	out_update(&iu->idev);
+	in_udev_invalidate(iu);
+	in_dev_changed(&iu->idev);
+}
+
+static void in_udev_uddev_sync(struct uddev *uddev)
+{
+	in_udev_invalidate(container_of(uddev, struct in_udev, uddev));
+}
+
+/* Unless the config maps the property to a specific uevent key, use
+ * the kernel's convention of "<SUBSYSTEM>_<PROPERTY>", in upper case. */
+static const char *in_udev_prop_key(struct in_udev *iu, const char *prop)
+{
+	const char *key;
+	char *k, *p;
+	size_t i;
+	int len;
+
+	for (i = 0; i < iu->n_keys; i++)
+		if (!strcmp(iu->keys[i].prop, prop))
+			return iu->keys[i].key;
+
+	len = asprintf(&k, "%s_%s", iu->uddev.subsys, prop);
+	assert(len >= 0);
+
+	for (p = k; *p; p++)
+		*p = isalnum(*p) ? toupper(*p) : '_';
+
+	key = arena_strdup(k);
+	free(k);
+	return key;
+}
+
+static struct in_udev_prop *in_udev_prop_get(struct in_udev *iu, const char *prop)
+{
+	struct in_udev_prop *p;
+	size_t i;
+
+	for (i = 0, p = iu->props; i < iu->n_props; i++, p++)
+		if (!strcmp(p->name, prop))
+			return p;
+
+	p = reallocarray(iu->props, iu->n_props + 1, sizeof(*iu->props));
+	assert(p);
+	iu->props = p;
+
+	p = &iu->props[iu->n_props++];
+	*p = (struct in_udev_prop) {
+		.name = prop,
+		.key = in_udev_prop_key(iu, prop),
+	};
+
+	return p;
+}
+
+static bool in_udev_parse(struct in_udev *iu, const char *prop, const char *val)
+{
+	if (!val) {
+		idev_dbg(&iu->idev, "Interpreting absence of property \"%s\" as false",
+			prop);
+		return false;
+	}
+
+	if (!strcmp(val, "0"))
+		return false;
+	else if (!strcmp(val, "1"))
+		return true;
+
+	idev_wrn(&iu->idev, "Interpreting available, but non-boolean, value of \"%s\" (%s), as true",
+		prop, val);
+	return true;
 }
 
 static int in_udev_sample(struct in_dev *idev, const char *prop, bool *state)
 {
 	struct in_udev *iu = container_of(idev, struct in_udev, idev);
+	struct in_udev_prop *p;
 	const char *val;
 
 	if (!uddev_present(&iu->uddev)) {
@@ -30,36 +136,55 @@ static int in_udev_sample(struct in_dev *idev, const char *prop, bool *state)
 		return 0;
 	}
 
-	val = udev_device_get_sysattr_value(iu->uddev.dev, prop);
-	if (!val) {
-		idev_dbg(&iu->idev, "Interpreting absence of property \"%s\" as false",
-			prop);
+	p = in_udev_prop_get(iu, prop);
+	if (!p->valid) {
+		val = udev_device_get_property_value(iu->uddev.dev, p->key);
+		if (!val)
+			val = udev_device_get_sysattr_value(iu->uddev.dev, prop);
 
-		*state = false;
-		return 0;
+		p->state = in_udev_parse(iu, prop, val);
+		p->valid = true;
 	}
 
-	if (!strcmp(val, "0")) {
-		*state = false;
-		return 0;
-	} else if (!strcmp(val, "1")) {
-		*state = true;
-		return 0;
+	*state = p->state;
+	return 0;
+}
+
+static int in_udev_probe_keys(struct in_udev *iu, json_t *keys)
+{
+	const char *prop;
+	json_t *key;
+
+	if (!json_is_object(keys)) {
+		idev_err(&iu->idev, "\"uevent\" must be an object");
+		return -EINVAL;
+	}
+
+	iu->keys = arena_allocarray(json_object_size(keys), sizeof(*iu->keys));
+
+	json_object_foreach(keys, prop, key) {
+		if (!json_is_string(key)) {
+			idev_err(&iu->idev, "uevent key of \"%s\" must be a string", prop);
+			return -EINVAL;
+		}
+
+		iu->keys[iu->n_keys++] = (struct in_udev_key) {
+			.prop = arena_strdup(prop),
+			.key = arena_strdup(json_string_value(key)),
+		};
 	}
 
-	idev_wrn(&iu->idev, "Interpreting available, but non-boolean, value of \"%s\" (%s), as true",
-		prop, val);
-	*state = true;
 	return 0;
 }
 
 static int in_udev_probe(const char *name, json_t *data)
 {
+	const char *subsys, *sysname;
 	struct in_udev *iu;
+	json_t *keys;
 	int err;
 
-	iu = calloc(1, sizeof(*iu));
-	assert(iu);
+	iu = arena_alloc(sizeof(*iu));
 
 	*iu = (struct in_udev) {
 		.idev = {
@@ -68,32 +193,38 @@ static int in_udev_probe(const char *name, json_t *data)
 		},
 		.uddev = {
 			.cb = in_udev_uddev_cb,
+			.sync = in_udev_uddev_sync,
 		},
 	};
 
-	err = json_unpack(data, "{s:s}", "subsystem", &iu->uddev.subsys);
+	err = json_unpack(data, "{s:s}", "subsystem", &subsys);
 	if (err) {
 		idev_err(&iu->idev, "Required property \"subsystem\" is missing");
-		goto err;
+		return err;
 	}
 
-	err = json_unpack(data, "{s:s}", "sysname", &iu->uddev.sysname);
+	err = json_unpack(data, "{s:s}", "sysname", &sysname);
 	if (err)
-		iu->uddev.sysname = name;
+		sysname = name;
+
+	iu->uddev.subsys = arena_strdup(subsys);
+	iu->uddev.sysname = arena_strdup(sysname);
+
+	if (!json_unpack(data, "{s:o}", "uevent", &keys)) {
+		err = in_udev_probe_keys(iu, keys);
+		if (err)
+			return err;
+	}
 
 	err = uddev_init(&iu->uddev);
 	if (err) {
 		idev_err(&iu->idev, "Unable to attach to udev");
-		goto err;
+		return err;
 	}
 
 	in_dev_add(&iu->idev);
 	uddev_start(&iu->uddev);
 	return 0;
-
-err:
-	free(iu);
-	return err;
 }
 
 const struct in_drv in_udev = {
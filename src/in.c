@@ -10,8 +10,7 @@ static void in_true_probe(void)
 {
 	struct in_dev *tru;
 
-	tru = calloc(1, sizeof(*tru));
-	assert(tru);
+	tru = arena_alloc(sizeof(*tru));
 
 	tru->name = "true";
 	tru->sample = in_true_sample;
@@ -20,55 +19,289 @@ static void in_true_probe(void)
 
 static struct in_dev **g_in_devs;
 static size_t g_in_devs_n;
+static size_t g_in_devs_max;
+static struct htab g_in_names;
 
-int in_dev_find(const char *nameprop, struct in_dev **idevp, const char **propp)
+static struct in_dev **g_in_dirty;
+static size_t g_in_dirty_n;
+static struct ev_prepare g_in_flush;
+
+static uint64_t *g_in_state;
+static size_t g_in_state_bits;
+
+const uint64_t *in_state(void)
 {
-	struct in_dev **idev;
-	const char *sep;
-	size_t i;
+	return g_in_state;
+}
+
+void in_state_set(unsigned int bit, bool state)
+{
+	if (state)
+		g_in_state[bit >> 6] |= 1ULL << (bit & 63);
+	else
+		g_in_state[bit >> 6] &= ~(1ULL << (bit & 63));
+}
+
+unsigned int in_state_alloc(void)
+{
+	uint64_t *state;
+
+	if (!(g_in_state_bits & 63)) {
+		state = reallocarray(g_in_state, (g_in_state_bits >> 6) + 1,
+				     sizeof(*g_in_state));
+		assert(state);
+
+		state[g_in_state_bits >> 6] = 0;
+		g_in_state = state;
+	}
+
+	return g_in_state_bits++;
+}
+
+static struct in_prop *in_prop_get(struct in_dev *idev, const char *name)
+{
+	struct in_prop *iprop;
+
+	for (iprop = idev->props; iprop; iprop = iprop->next) {
+		if ((!iprop->name && !name) ||
+		    (iprop->name && name && !strcmp(iprop->name, name)))
+			return iprop;
+	}
+
+	iprop = arena_alloc(sizeof(*iprop));
+
+	*iprop = (struct in_prop) {
+		.next = idev->props,
+		.idev = idev,
+		.name = arena_strdup(name),
+		.bit = in_state_alloc(),
+	};
+
+	idev->props = iprop;
+	return iprop;
+}
+
+int in_prop_find(const char *nameprop, struct in_prop **ipropp)
+{
+	const char *sep, *prop = NULL;
+	struct hnode *hn;
+	char *name;
 
 	sep = index(nameprop, ':');
 	if (sep)
-		*propp = sep + 1;
+		prop = sep + 1;
 	else
 		sep = index(nameprop, '\0');
 
-	for (i = 0, idev = g_in_devs; i < g_in_devs_n; i++, idev++) {
-		if (!strncmp(nameprop, (*idev)->name, sep - nameprop)) {
-			*idevp = *idev;
-			return 0;
+	name = strndup(nameprop, sep - nameprop);
+	assert(name);
+
+	hn = htab_find(&g_in_names, name);
+	free(name);
+
+	if (!hn) {
+		log_dbg("Found no input device matching \"%s\"", nameprop);
+		return -ENODEV;
+	}
+
+	*ipropp = in_prop_get(container_of(hn, struct in_dev, node), prop);
+	return 0;
+}
+
+/* Sample all referenced properties of an input into the state
+ * vector. This is done once per change, no matter how many rules
+ * reference the input. Properties that fail to be sampled keep their
+ * last known state. */
+static int in_dev_sample(struct in_dev *idev, bool notify)
+{
+	struct in_prop *iprop;
+	int err = 0, ret;
+	bool state;
+
+	for (iprop = idev->props; iprop; iprop = iprop->next) {
+		ret = idev->sample(idev, iprop->name, &state);
+		if (ret) {
+			idev_err(idev, "Failed to sample \"%s\" (%d)",
+				 iprop->name ? : "", ret);
+			err = err ? : ret;
+			continue;
 		}
+
+		if (state == in_state_test(g_in_state, iprop->bit))
+			continue;
+
+		in_state_set(iprop->bit, state);
+
+		if (notify && iprop->cond)
+			cond_changed(iprop->cond);
 	}
 
-	log_dbg("Found no input device matching \"%s\"", nameprop);
-	return -ENODEV;
+	return err;
 }
 
-void in_dev_add(struct in_dev *idev)
+/* Sample all inputs that have changed since the last flush, and run
+ * a single update pass over the outputs that are affected by them,
+ * along with any that are queued for a retry. Outputs are only
+ * updated if any property actually flipped. A failure to sample one
+ * input does not hold back the others, the first error is reported
+ * once all of them have been processed. */
+int in_flush(void)
 {
-	struct in_dev **idevs;
+	struct in_dev *idev;
+	int err = 0, ret;
+	size_t i;
+
+	for (i = 0; i < g_in_dirty_n; i++) {
+		idev = g_in_dirty[i];
+		idev->dirty = false;
+
+		ret = in_dev_sample(idev, true);
+		err = err ? : ret;
+	}
 
-	idevs = reallocarray(g_in_devs, g_in_devs_n + 1, sizeof(*g_in_devs));
-	assert(idevs);
+	g_in_dirty_n = 0;
+
+	cond_update();
+	return out_flush() ? : err;
+}
+
+static void in_flush_cb(struct ev_loop *loop, struct ev_prepare *w, int revents)
+{
+	ev_prepare_stop(loop, w);
+	in_flush();
+}
+
+/* Have in_flush() run before the event loop blocks again */
+void in_flush_schedule(void)
+{
+	ev_prepare_start(ev_default_loop(0), &g_in_flush);
+}
+
+static void in_dev_mark(struct in_dev *idev)
+{
+	if (idev->dirty)
+		return;
+
+	idev->dirty = true;
+	g_in_dirty[g_in_dirty_n++] = idev;
+
+	in_flush_schedule();
+}
+
+static void in_dev_coalesce_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+	in_dev_mark(container_of(w, struct in_dev, coalesce_timer));
+}
+
+/* Called by drivers when an input may have changed state. The input
+ * is sampled before the event loop blocks again, such that all
+ * changes reported in one iteration result in a single update. */
+void in_dev_changed(struct in_dev *idev)
+{
+	if (!idev->coalesce) {
+		in_dev_mark(idev);
+		return;
+	}
+
+	/* The window is not extended by subsequent changes, to bound
+	 * the latency of a continuously changing input. */
+	if (!ev_is_active(&idev->coalesce_timer))
+		ev_timer_start(ev_default_loop(0), &idev->coalesce_timer);
+}
+
+/* Sample all inputs. Like in_flush(), the first error is only
+ * reported once every input has been sampled. */
+int in_refresh(void)
+{
+	int err = 0, ret;
+	size_t i;
+
+	for (i = 0; i < g_in_devs_n; i++) {
+		ret = in_dev_sample(g_in_devs[i], false);
+		err = err ? : ret;
+	}
+
+	return err;
+}
+
+/* Make room for at least n inputs. in_probe() reserves room for all
+ * inputs in the config up front, so this normally only allocates
+ * once. */
+static void in_devs_reserve(size_t n)
+{
+	struct in_dev **idevs, **dirty;
+
+	if (n <= g_in_devs_max)
+		return;
+
+	if (n < g_in_devs_max * 2)
+		n = g_in_devs_max * 2;
+
+	idevs = arena_allocarray(n, sizeof(*idevs));
+	dirty = arena_allocarray(n, sizeof(*dirty));
+
+	if (g_in_devs_n)
+		memcpy(idevs, g_in_devs, g_in_devs_n * sizeof(*idevs));
+	if (g_in_dirty_n)
+		memcpy(dirty, g_in_dirty, g_in_dirty_n * sizeof(*dirty));
 
-	idevs[g_in_devs_n++] = idev;
 	g_in_devs = idevs;
+	g_in_dirty = dirty;
+	g_in_devs_max = n;
+}
+
+void in_dev_add(struct in_dev *idev)
+{
+	in_devs_reserve(g_in_devs_n + 1);
+	g_in_devs[g_in_devs_n++] = idev;
+
+	/* Conditions refer to the first input of a given name */
+	if (htab_find(&g_in_names, idev->name))
+		idev_wrn(idev, "Shadowed by another input of the same name");
+
+	htab_add(&g_in_names, &idev->node, idev->name);
+
+	ev_timer_init(&idev->coalesce_timer, in_dev_coalesce_cb, 0., 0.);
 }
 
+extern const struct in_drv in_cgroup;
+extern const struct in_drv in_flags;
 extern const struct in_drv in_path;
+extern const struct in_drv in_pid;
+extern const struct in_drv in_sysfs;
 extern const struct in_drv in_udev;
 
 static const struct in_drv *in_drvs[] = {
+	&in_cgroup,
+	&in_flags,
 	&in_path,
+	&in_pid,
+	&in_sysfs,
 	&in_udev,
 
 	NULL
 };
 
+/* Options that are common to all input drivers */
+static int in_dev_opts(struct in_dev *idev, json_t *data)
+{
+	json_int_t ms = 0;
+
+	if (json_unpack(data, "{s?I}", "coalesce", &ms) || ms < 0) {
+		idev_err(idev, "\"coalesce\" must be a non-negative number of milliseconds");
+		return -EINVAL;
+	}
+
+	idev->coalesce = ms / 1000.;
+	ev_timer_set(&idev->coalesce_timer, idev->coalesce, 0.);
+	return 0;
+}
+
 static int in_probe_drv(const char *drvname, json_t *devs)
 {
 	const struct in_drv **drv;
 	const char *name;
+	size_t i, first;
 	json_t *data;
 	int err;
 
@@ -84,12 +317,23 @@ static int in_probe_drv(const char *drvname, json_t *devs)
 	json_object_foreach(devs, name, data) {
 		log_dbg("Probing %s input \"%s\"", drvname, name);
 
+		/* The config is released after probing */
+		name = arena_strdup(name);
+
+		first = g_in_devs_n;
+
 		err = (*drv)->probe(name, data);
 		if (err) {
 			log_err("Failed probing %s input \"%s\" (%d)",
 				drvname, name, err);
 			return err;
 		}
+
+		for (i = first; i < g_in_devs_n; i++) {
+			err = in_dev_opts(g_in_devs[i], data);
+			if (err)
+				return err;
+		}
 	}
 
 	return 0;
@@ -97,10 +341,19 @@ static int in_probe_drv(const char *drvname, json_t *devs)
 
 int in_probe(json_t *ins)
 {
+	ev_tstamp start = ev_time();
 	const char *name;
 	json_t *devs;
+	size_t n;
 	int err;
 
+	ev_prepare_init(&g_in_flush, in_flush_cb);
+
+	n = 1;
+	json_object_foreach(ins, name, devs)
+		n += json_object_size(devs);
+
+	in_devs_reserve(n);
 	in_true_probe();
 
 	json_object_foreach(ins, name, devs) {
@@ -109,6 +362,7 @@ int in_probe(json_t *ins)
 			return err;
 	}
 
-	log_not("Successfully probed %zu inputs", g_in_devs_n);
+	log_not("Successfully probed %zu inputs in %.1fms", g_in_devs_n,
+		(ev_time() - start) * 1000.);
 	return 0;
 }
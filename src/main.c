@@ -19,7 +19,7 @@ int alias_resolve(json_t **aliasp)
 		return -ENOENT;
 	}
 
-	json_decref(*aliasp);
+	/* Both references are borrowed from the config */
 	*aliasp = alias;
 	return 0;
 }
@@ -39,6 +39,7 @@ static void sigusr1_cb(struct ev_loop *loop, struct ev_signal *sig, int revents)
 static void sigusr2_cb(struct ev_loop *loop, struct ev_signal *sig, int revents)
 {
 	out_dump();
+	uddev_dump();
 }
 
 #define DEFAULT_CONFIG SYSCONFDIR "/iitod.json"
@@ -57,18 +58,20 @@ static void usage()
 		"  -d, --debug         In addition to syslog, also log to stderr\n"
 		"  -f, --config=FILE   Use configuration from FILE instead of %s\n"
 		"  -h, --help          Print usage message and exit\n"
+		"  -k, --kernel-filter Have the kernel drop uevents from untracked devices\n"
 		"  -l, --loglevel=LVL  Log level: none, err, warn, notice*, info, debug\n"
 		"  -v, --version       Print version information\n",
 		DEFAULT_CONFIG);
 }
 
-static const char *sopts = "df:hl:v";
+static const char *sopts = "df:hkl:v";
 static struct option lopts[] = {
-	{ "debug",    no_argument,       0, 'd' },
-	{ "config",   required_argument, 0, 'f' },
-	{ "help",     no_argument,       0, 'h' },
-	{ "loglevel", required_argument, 0, 'l' },
-	{ "version",  no_argument,       0, 'v' },
+	{ "debug",         no_argument,       0, 'd' },
+	{ "config",        required_argument, 0, 'f' },
+	{ "help",          no_argument,       0, 'h' },
+	{ "kernel-filter", no_argument,       0, 'k' },
+	{ "loglevel",      required_argument, 0, 'l' },
+	{ "version",       no_argument,       0, 'v' },
 
 	{ NULL }
 };
@@ -105,6 +108,9 @@ int main(int argc, char **argv)
 		case 'h':
 			usage();
 			return 0;
+		case 'k':
+			uddev_kfilter(true);
+			break;
 		case 'l':
 			logmask = logmask_from_str(optarg);
 			if (logmask < 0) {
@@ -162,7 +168,15 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	err = out_update(NULL);
+	uddev_enum_done();
+
+	/* Everything needed at runtime has been compiled into the
+	 * arena at this point. */
+	json_decref(g_config);
+	g_config = NULL;
+	arena_log();
+
+	err = out_update();
 	if (err) {
 		log_cri("Unable to set initial output states (%d)\n", err);
 		return 1;
@@ -1,177 +1,1040 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
 #include "iito.h"
 
-#define _PATH_SYSFS_LED "/sys/class/leds"
+/* All attributes written by any rule are registered at probe time,
+ * such that each one can be referred to by its index. Those following
+ * OUT_LED_ATTR_TRIGGER_ATTRS are created by the active trigger, and
+ * go away whenever it is changed. */
+enum {
+	OUT_LED_ATTR_TRIGGER,
+	OUT_LED_ATTR_BRIGHTNESS,
+
+	OUT_LED_ATTR_TRIGGER_ATTRS
+};
+
+static const char **g_out_led_attrs;
+static size_t g_out_led_attrs_n;
+
+/* A preformatted attribute value */
+struct out_led_val {
+	unsigned int attr;
+	const char *val;
+	size_t len;
+};
+
+/* A rule's state, compiled from its "then" object at probe time, so
+ * that applying it requires no parsing or formatting. */
+struct out_led_action {
+	struct out_led_val trigger;
+
+	/* Either max_brightness, which is only known per LED, or a
+	 * fixed value. */
+	bool max;
+	int brightness;
+	struct out_led_val brightness_val;
+
+	struct out_led_val *attrs;
+	size_t n_attrs;
+};
+
+static const struct out_led_action out_led_default = {
+	.trigger = { OUT_LED_ATTR_TRIGGER, "none", 4 },
+	.brightness_val = { OUT_LED_ATTR_BRIGHTNESS, "0", 1 },
+};
+
+/* The last state written to an LED, used to avoid writing attributes
+ * that already have the requested value. Values refer to the action
+ * records, which live for as long as the program. A valid shadow
+ * without an action holds the state that the LED was found in at
+ * startup. */
+struct out_led_shadow {
+	bool valid;
+	const struct out_led_action *act;
+
+	const char *trigger;
+	int brightness;
+	const struct out_led_val **attrs;
+	size_t n_attrs;
+};
+
+/* The state of an LED's device, i.e. its sysfs directory, the
+ * attributes that have been opened so far and the shadow copy of what
+ * was last written to them. It is only ever accessed by the LED's
+ * writer, which is either the event loop or its bus worker. */
+struct out_led_hw {
+	int dirfd;
+
+	int max_brightness;
+	struct out_led_val max_val;
+	char max_str[12];
+
+	struct out_led_shadow shadow;
+
+	/* Open attributes, indexed like g_out_led_attrs */
+	int *fds;
+	size_t n_fds;
+};
+
+/* A request to a writer. A reset replaces the device, e.g. after a
+ * hotplug, and an apply writes the state of a rule. */
+struct out_led_req {
+	bool reset;
+	int dirfd;
+	int max_brightness;
+
+	bool apply;
+	struct out_rule *rule;
+};
 
+/* LEDs behind slow buses, e.g. I2C GPIO expanders, are written by a
+ * worker thread per bus, so that the event loop never blocks on the
+ * hardware. Each LED has at most one pending request, and a new
+ * request supersedes any pending one, so the queue is bounded by the
+ * number of LEDs on the bus and stale states are never written. */
+struct out_led_bus {
+	struct hnode node;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct out_led *head;
+	struct out_led **tail;
+
+	/* LEDs whose requests have failed, to be retried by the
+	 * event loop */
+	struct out_led *failed;
+	struct ev_async async;
+};
+
+/* An LED is either an output of its own, or a member of a group, in
+ * which case owner refers to the group's output and odev only carries
+ * the LED's name. */
 struct out_led {
 	struct out_dev odev;
+	struct out_dev *owner;
 	struct uddev uddev;
 
-	int max_brightness;
+	/* Protected by bus->lock */
+	struct out_led_bus *bus;
+	struct out_led_req req;
+	struct out_led *next;
+	bool queued;
+	struct out_led *failed_next;
+	bool failed;
+
+	struct out_led_hw hw;
 };
 
-static int out_led_apply(struct out_dev *odev, struct out_rule *rule)
+struct out_led_group {
+	struct out_dev odev;
+
+	struct out_led **leds;
+	size_t n_leds;
+};
+
+static unsigned int out_led_attr_id(const char *name)
 {
-	struct out_led *ol = container_of(odev, struct out_led, odev);
-	const char *key, *trigger = "none";
-	int brightness = 0;
+	const char **attrs;
+	size_t i;
+
+	if (!g_out_led_attrs_n) {
+		g_out_led_attrs = calloc(OUT_LED_ATTR_TRIGGER_ATTRS,
+					 sizeof(*g_out_led_attrs));
+		assert(g_out_led_attrs);
+
+		g_out_led_attrs[OUT_LED_ATTR_TRIGGER] = "trigger";
+		g_out_led_attrs[OUT_LED_ATTR_BRIGHTNESS] = "brightness";
+		g_out_led_attrs_n = OUT_LED_ATTR_TRIGGER_ATTRS;
+	}
+
+	for (i = 0; i < g_out_led_attrs_n; i++)
+		if (!strcmp(g_out_led_attrs[i], name))
+			return i;
+
+	attrs = reallocarray(g_out_led_attrs, g_out_led_attrs_n + 1,
+			     sizeof(*attrs));
+	assert(attrs);
+
+	attrs[g_out_led_attrs_n] = arena_strdup(name);
+
+	g_out_led_attrs = attrs;
+	return g_out_led_attrs_n++;
+}
+
+static int out_led_val_compile(struct out_led_val *v, const char *key, json_t *val)
+{
+	char buf[32];
+	const char *str;
+
+	switch (json_typeof(val)) {
+	case JSON_STRING:
+		str = json_string_value(val);
+		break;
+	case JSON_INTEGER:
+		snprintf(buf, sizeof(buf), "%" JSON_INTEGER_FORMAT,
+			 json_integer_value(val));
+		str = buf;
+		break;
+	case JSON_TRUE:
+		str = "1";
+		break;
+	case JSON_FALSE:
+		str = "0";
+		break;
+	case JSON_NULL:
+		str = "";
+		break;
+	default:
+		log_err("(led) Unable to handle attribute \"%s\"", key);
+		return -EINVAL;
+	}
+
+	*v = (struct out_led_val) {
+		.attr = out_led_attr_id(key),
+		.val = arena_strdup(str),
+		.len = strlen(str),
+	};
+	return 0;
+}
+
+static int out_led_compile(struct out_rule *rule)
+{
+	struct out_led_action *act;
+	const char *key, *trigger;
+	int brightness, err;
 	bool set_max;
+	char buf[12];
 	json_t *val;
 
-	if (!uddev_present(&ol->uddev)) {
+	act = arena_alloc(sizeof(*act));
+
+	if (json_unpack(rule->state, "{s:s}", "trigger", &trigger))
+		trigger = "none";
+
+	act->trigger = (struct out_led_val) {
+		.attr = OUT_LED_ATTR_TRIGGER,
+		.val = arena_strdup(trigger),
+		.len = strlen(trigger),
+	};
+
+	/* Special handling of brightness: may be either bool or
+	 * int. Interpret a bool as either 0 (false) or the LED's
+	 * max_brightness (true) */
+	if (!json_unpack(rule->state, "{s:b}", "brightness", &set_max)) {
+		act->max = set_max;
+		brightness = 0;
+	} else if (json_unpack(rule->state, "{s:i}", "brightness", &brightness)) {
+		act->max = true;
+	}
+
+	if (!act->max) {
+		snprintf(buf, sizeof(buf), "%d", brightness);
+
+		act->brightness = brightness;
+		act->brightness_val = (struct out_led_val) {
+			.attr = OUT_LED_ATTR_BRIGHTNESS,
+			.val = arena_strdup(buf),
+			.len = strlen(buf),
+		};
+	}
+
+	/* Then any trigger specific attributes, if specified */
+
+	act->attrs = arena_allocarray(json_object_size(rule->state),
+				      sizeof(*act->attrs));
+
+	json_object_foreach(rule->state, key, val) {
+		if (!strcmp(key, "trigger") || !strcmp(key, "brightness"))
+			continue;
+
+		err = out_led_val_compile(&act->attrs[act->n_attrs], key, val);
+		if (err)
+			return err;
+
+		act->n_attrs++;
+	}
+
+	rule->priv = act;
+	return 0;
+}
+
+static int out_led_compile_rules(const char *name, struct out_rule *rules,
+				 size_t n_rules)
+{
+	size_t i;
+	int err;
+
+	for (i = 0; i < n_rules; i++) {
+		err = out_led_compile(&rules[i]);
+		if (err) {
+			log_err("(led) %s: Unable to compile rule %zu (%d)",
+				name, i, err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static int out_led_write(struct out_led *ol, const struct out_led_val *v)
+{
+	const char *attr = g_out_led_attrs[v->attr];
+	struct out_led_hw *hw = &ol->hw;
+	int *fds;
+
+	if (v->attr >= hw->n_fds) {
+		fds = reallocarray(hw->fds, g_out_led_attrs_n, sizeof(*fds));
+		assert(fds);
+
+		for (; hw->n_fds < g_out_led_attrs_n; hw->n_fds++)
+			fds[hw->n_fds] = -1;
+
+		hw->fds = fds;
+	}
+
+	/* Attributes are opened on first use, and are then kept open,
+	 * saving the path lookup and the open/close of every write. */
+	if (hw->fds[v->attr] < 0) {
+		hw->fds[v->attr] = openat(hw->dirfd, attr, O_WRONLY | O_CLOEXEC);
+		if (hw->fds[v->attr] < 0) {
+			odev_err(&ol->odev, "Unable to open \"%s\" (%d)", attr, -errno);
+			return -errno;
+		}
+	}
+
+	if (pwrite(hw->fds[v->attr], v->val, v->len, 0) < 0) {
+		odev_err(&ol->odev, "Unable to set \"%s\" to \"%.*s\" (%d)",
+			 attr, (int)v->len, v->val, -errno);
+
+		/* Reopen on the next write, in case it went stale */
+		close(hw->fds[v->attr]);
+		hw->fds[v->attr] = -1;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static void out_led_fds_close(struct out_led *ol, unsigned int first)
+{
+	struct out_led_hw *hw = &ol->hw;
+	size_t i;
+
+	for (i = first; i < hw->n_fds; i++) {
+		if (hw->fds[i] < 0)
+			continue;
+
+		close(hw->fds[i]);
+		hw->fds[i] = -1;
+	}
+}
+
+/* Triggers whose output follows a timer, which must be restarted in
+ * order for multiple LEDs to blink in unison. */
+static bool out_led_trigger_timed(const char *trigger)
+{
+	static const char *timed[] = { "timer", "pattern", "heartbeat", NULL };
+	const char **t;
+
+	for (t = timed; *t; t++)
+		if (!strcmp(*t, trigger))
+			return true;
+
+	return false;
+}
+
+/* Attributes are registered while probing, which may be after this
+ * LED was set up. */
+static void out_led_shadow_grow(struct out_led *ol)
+{
+	struct out_led_shadow *sh = &ol->hw.shadow;
+	const struct out_led_val **attrs;
+
+	if (sh->n_attrs >= g_out_led_attrs_n)
+		return;
+
+	attrs = reallocarray(sh->attrs, g_out_led_attrs_n, sizeof(*attrs));
+	assert(attrs);
+
+	memset(&attrs[sh->n_attrs], 0,
+	       (g_out_led_attrs_n - sh->n_attrs) * sizeof(*attrs));
+
+	sh->attrs = attrs;
+	sh->n_attrs = g_out_led_attrs_n;
+}
+
+static void out_led_shadow_reset(struct out_led *ol)
+{
+	struct out_led_shadow *sh = &ol->hw.shadow;
+
+	out_led_shadow_grow(ol);
+
+	*sh = (struct out_led_shadow) {
+		.attrs = sh->attrs,
+		.n_attrs = sh->n_attrs,
+	};
+
+	if (sh->n_attrs)
+		memset(sh->attrs, 0, sh->n_attrs * sizeof(*sh->attrs));
+}
+
+static bool out_led_shadow_match(struct out_led *ol, const struct out_led_val *v)
+{
+	const struct out_led_val *cur = ol->hw.shadow.attrs[v->attr];
+
+	return cur && cur->len == v->len && !memcmp(cur->val, v->val, v->len);
+}
+
+static void out_led_hw_reset(struct out_led *ol, int dirfd, int max_brightness)
+{
+	struct out_led_hw *hw = &ol->hw;
+
+	out_led_fds_close(ol, 0);
+	if (hw->dirfd >= 0)
+		close(hw->dirfd);
+
+	hw->dirfd = dirfd;
+	hw->max_brightness = max_brightness;
+	hw->max_val = (struct out_led_val) {
+		.attr = OUT_LED_ATTR_BRIGHTNESS,
+		.val = hw->max_str,
+		.len = snprintf(hw->max_str, sizeof(hw->max_str), "%d",
+				max_brightness),
+	};
+
+	out_led_shadow_reset(ol);
+}
+
+/* Whether an LED that was adopted at startup is already running the
+ * action's trigger, with all of its attributes set. */
+static bool out_led_shadow_holds(struct out_led *ol,
+				 const struct out_led_action *act)
+{
+	struct out_led_shadow *sh = &ol->hw.shadow;
+	size_t i;
+
+	if (sh->act || strcmp(sh->trigger, act->trigger.val))
+		return false;
+
+	for (i = 0; i < act->n_attrs; i++)
+		if (!out_led_shadow_match(ol, &act->attrs[i]))
+			return false;
+
+	return true;
+}
+
+static int out_led_set(struct out_led *ol, struct out_rule *rule)
+{
+	const struct out_led_action *act = rule ? rule->priv : &out_led_default;
+	static const struct out_led_val none = { OUT_LED_ATTR_TRIGGER, "none", 4 };
+	static const struct out_led_val off = { OUT_LED_ATTR_BRIGHTNESS, "0", 1 };
+	struct out_led_shadow *sh = &ol->hw.shadow;
+	const struct out_led_val *bval;
+	int brightness, n = 0;
+	size_t i;
+
+	if (ol->hw.dirfd < 0) {
 		odev_dbg(&ol->odev, "Absent, not applying");
 		return 0;
 	}
 
-	if (rule) {
-		if (json_unpack(rule->state, "{s:s}", "trigger", &trigger))
-			trigger = "none";
+	out_led_shadow_grow(ol);
 
-		/* Special handling of brightness: may be either bool
-		 * or int. Interpret a bool as either 0 (false) or the
-		 * LED's max_brightness (true) */
-		if (!json_unpack(rule->state, "{s:b}", "brightness", &set_max))
-			brightness = set_max ? ol->max_brightness : 0;
-		else if (json_unpack(rule->state, "{s:i}", "brightness", &brightness))
-			brightness = ol->max_brightness;
+	if (act->max) {
+		brightness = ol->hw.max_brightness;
+		bval = &ol->hw.max_val;
+	} else {
+		brightness = act->brightness;
+		bval = &act->brightness_val;
 	}
 
-	/* Always set trigger and brightness, which have default
-	 * fallback values.
+	/* Only write the attributes that differ from the shadow copy
+	 * of the LED's current state.
 	 *
-	 * We make sure to always start from none/0 because when
-	 * multiple LED's are being updated due to some shared event,
-	 * we want their timers to start counting as close together as
-	 * possible - to get the appearence of them blinking in
-	 * unison.
+	 * The exception is when moving to a timed trigger. Then we
+	 * start from none/0 because when multiple LED's are being
+	 * updated due to some shared event, we want their timers to
+	 * start counting as close together as possible - to get the
+	 * appearence of them blinking in unison.
 	 */
 
-	if (uddev_set_sysfs(&ol->uddev, "trigger", "none") ||
-	    uddev_set_sysfs(&ol->uddev, "brightness", "0"))
-		return -EIO;
+	if (sh->valid && sh->act != act && out_led_trigger_timed(act->trigger.val) &&
+	    !out_led_shadow_holds(ol, act)) {
+		if (out_led_write(ol, &none) || out_led_write(ol, &off))
+			goto err;
 
-	if (uddev_set_sysfs(&ol->uddev, "trigger", trigger) ||
-	    uddev_set_sysfs(&ol->uddev, "brightness", "%d", brightness))
-		return -EIO;
+		n += 2;
+		out_led_shadow_reset(ol);
+		out_led_fds_close(ol, OUT_LED_ATTR_TRIGGER_ATTRS);
+	}
 
-	odev_dbg(&ol->odev, "Set trigger:%s brightness:%d", trigger, brightness);
+	/* Changing the trigger resets its attributes, and may affect
+	 * the brightness. */
+	if (!sh->valid || strcmp(sh->trigger, act->trigger.val)) {
+		if (out_led_write(ol, &act->trigger))
+			goto err;
 
-	if (!rule)
-		return 0;
+		n++;
+		out_led_shadow_reset(ol);
+		out_led_fds_close(ol, OUT_LED_ATTR_TRIGGER_ATTRS);
+
+		sh->trigger = act->trigger.val;
+		sh->brightness = -1;
+	}
+
+	if (sh->brightness != brightness) {
+		if (out_led_write(ol, bval))
+			goto err;
+
+		n++;
+		sh->brightness = brightness;
+	}
+
+	sh->valid = true;
+	sh->act = act;
 
 	/* Then apply any trigger specific attributes, if specified */
 
-	json_object_foreach(rule->state, key, val) {
-		if (!strcmp(key, "trigger") || !strcmp(key, "brightness"))
+	for (i = 0; i < act->n_attrs; i++) {
+		if (out_led_shadow_match(ol, &act->attrs[i]))
 			continue;
 
-		switch (json_typeof(val)) {
-		case JSON_STRING:
-			if (uddev_set_sysfs(&ol->uddev, key, json_string_value(val)))
-				return -EIO;
-			break;
-		case JSON_INTEGER:
-			if (uddev_set_sysfs(&ol->uddev, key, "%d", json_integer_value(val)))
-				return -EIO;
-			break;
-		case JSON_TRUE:
-			if (uddev_set_sysfs(&ol->uddev, key, "1"))
-				return -EIO;
-			break;
-		case JSON_FALSE:
-			if (uddev_set_sysfs(&ol->uddev, key, "0"))
-				return -EIO;
-			break;
-		case JSON_NULL:
-			if (uddev_set_sysfs(&ol->uddev, key, ""))
-				return -EIO;
-			break;
-		default:
-			odev_err(&ol->odev, "Unable to handle attribute \"%s\"", key);
-			return -EINVAL;
+		if (out_led_write(ol, &act->attrs[i]))
+			goto err;
+
+		n++;
+		sh->attrs[act->attrs[i].attr] = &act->attrs[i];
+	}
+
+	/* Writing a zero brightness also removes the trigger */
+	if (!brightness && strcmp(act->trigger.val, "none"))
+		sh->valid = false;
+
+	odev_dbg(&ol->odev, "Set trigger:%s brightness:%d (%d writes)",
+		 act->trigger.val, brightness, n);
+	return 0;
+
+err:
+	/* The LED is in an unknown state, start over next time */
+	out_led_shadow_reset(ol);
+	return -EIO;
+}
+
+static int out_led_exec(struct out_led *ol, const struct out_led_req *req)
+{
+	if (req->reset)
+		out_led_hw_reset(ol, req->dirfd, req->max_brightness);
+
+	if (req->apply)
+		return out_led_set(ol, req->rule);
+
+	return 0;
+}
+
+static void *out_led_bus_worker(void *_bus)
+{
+	struct out_led_bus *bus = _bus;
+	struct out_led_req req;
+	struct out_led *ol;
+	int err;
+
+	pthread_mutex_lock(&bus->lock);
+
+	for (;;) {
+		while (!bus->head)
+			pthread_cond_wait(&bus->cond, &bus->lock);
+
+		ol = bus->head;
+		bus->head = ol->next;
+		if (!bus->head)
+			bus->tail = &bus->head;
+
+		req = ol->req;
+		ol->req = (struct out_led_req) { 0 };
+		ol->queued = false;
+
+		pthread_mutex_unlock(&bus->lock);
+
+		err = out_led_exec(ol, &req);
+		if (err)
+			odev_err(&ol->odev, "Failed to apply state (%d)", err);
+
+		pthread_mutex_lock(&bus->lock);
+
+		if (err && !ol->failed) {
+			ol->failed = true;
+			ol->failed_next = bus->failed;
+			bus->failed = ol;
+			ev_async_send(ev_default_loop(0), &bus->async);
 		}
 	}
 
+	return NULL;
+}
+
+/* The owners of LEDs whose writes have failed no longer know what
+ * state they are in, have their active rules reapplied. */
+static void out_led_bus_async_cb(struct ev_loop *loop, struct ev_async *w,
+				 int revents)
+{
+	struct out_led_bus *bus = container_of(w, struct out_led_bus, async);
+	struct out_led *ol;
+
+	pthread_mutex_lock(&bus->lock);
+
+	for (ol = bus->failed; ol; ol = ol->failed_next) {
+		ol->failed = false;
+		out_dev_retry(ol->owner);
+	}
+
+	bus->failed = NULL;
+	pthread_mutex_unlock(&bus->lock);
+}
+
+/* Hand a request to the LED's writer. Without a bus worker, it is
+ * executed right away. Otherwise it is merged into any request that
+ * is still pending, and errors are reported by the worker, which has
+ * the LED's owner retry its active rule. */
+static int out_led_submit(struct out_led *ol, const struct out_led_req *req)
+{
+	struct out_led_bus *bus = ol->bus;
+
+	if (!bus)
+		return out_led_exec(ol, req);
+
+	pthread_mutex_lock(&bus->lock);
+
+	if (req->reset) {
+		/* The superseded device was never handed over */
+		if (ol->req.reset && ol->req.dirfd >= 0)
+			close(ol->req.dirfd);
+
+		ol->req.reset = true;
+		ol->req.dirfd = req->dirfd;
+		ol->req.max_brightness = req->max_brightness;
+	}
+
+	if (req->apply) {
+		ol->req.apply = true;
+		ol->req.rule = req->rule;
+	}
+
+	if (!ol->queued) {
+		ol->queued = true;
+		ol->next = NULL;
+		*bus->tail = ol;
+		bus->tail = &ol->next;
+
+		pthread_cond_signal(&bus->cond);
+	}
+
+	pthread_mutex_unlock(&bus->lock);
 	return 0;
 }
 
-static void out_led_set_max(struct out_led *ol)
+static int out_led_apply(struct out_dev *odev, struct out_rule *rule)
+{
+	struct out_led *ol = container_of(odev, struct out_led, odev);
+	struct out_led_req req = {
+		.apply = true,
+		.rule = rule,
+	};
+
+	return out_led_submit(ol, &req);
+}
+
+/* Find the I2C or SPI controller, if any, that dev, or any of its
+ * ancestors, is attached through. */
+static const char *out_led_bus_ctrl(struct udev_device *dev)
+{
+	struct udev_device *ctrl;
+	const char *subsys;
+
+	for (; dev; dev = udev_device_get_parent(dev)) {
+		subsys = udev_device_get_subsystem(dev);
+		if (!subsys || (strcmp(subsys, "i2c") && strcmp(subsys, "spi")))
+			continue;
+
+		ctrl = udev_device_get_parent(dev);
+		return udev_device_get_syspath(ctrl ? : dev);
+	}
+
+	return NULL;
+}
+
+/* Find the controller of a device that dev depends on, e.g. the I2C
+ * GPIO expander providing the GPIO of a gpio-leds LED, whose own
+ * parents are all platform devices. Such dependencies are listed as
+ * "supplier:*" device links by the driver core. */
+static const char *out_led_bus_supplier(struct udev_device *dev, char *buf,
+					size_t size)
+{
+	struct udev_device *sup;
+	const char *syspath, *ctrl = NULL;
+	char link[PATH_MAX], *path;
+	struct dirent *ent;
+	DIR *dir;
+
+	syspath = udev_device_get_syspath(dev);
+
+	dir = opendir(syspath);
+	if (!dir)
+		return NULL;
+
+	while (!ctrl && (ent = readdir(dir))) {
+		if (strncmp(ent->d_name, "supplier:", 9))
+			continue;
+
+		snprintf(link, sizeof(link), "%s/%s/supplier", syspath, ent->d_name);
+		path = realpath(link, NULL);
+		if (!path)
+			continue;
+
+		sup = udev_device_new_from_syspath(udev_device_get_udev(dev), path);
+		free(path);
+		if (!sup)
+			continue;
+
+		/* The supplier is released along with its path */
+		ctrl = out_led_bus_ctrl(sup);
+		if (ctrl) {
+			snprintf(buf, size, "%s", ctrl);
+			ctrl = buf;
+		}
+
+		udev_device_unref(sup);
+	}
+
+	closedir(dir);
+	return ctrl;
+}
+
+/* Find the bus that the LED is attached through, either directly, or
+ * through a supplier of its controller. Only the controller's
+ * suppliers are considered, those of devices further up are typically
+ * shared by every device on the SoC. */
+static const char *out_led_bus_path(struct udev_device *dev, char *buf,
+				    size_t size)
+{
+	struct udev_device *parent;
+	const char *path;
+
+	path = out_led_bus_ctrl(dev);
+	if (path)
+		return path;
+
+	path = out_led_bus_supplier(dev, buf, size);
+	if (path)
+		return path;
+
+	parent = udev_device_get_parent(dev);
+	return parent ? out_led_bus_supplier(parent, buf, size) : NULL;
+}
+
+static struct out_led_bus *out_led_bus_get(struct out_led *ol, int async)
+{
+	static struct htab buses;
+	struct out_led_bus *bus;
+	struct udev_device *parent;
+	char buf[PATH_MAX];
+	struct hnode *hn;
+	const char *path;
+	int err;
+
+	if (!async)
+		return NULL;
+
+	path = out_led_bus_path(ol->uddev.dev, buf, sizeof(buf));
+
+	/* Forced onto a worker, which is shared by all LEDs of the
+	 * same controller */
+	if (!path && async > 0) {
+		parent = udev_device_get_parent(ol->uddev.dev);
+		path = udev_device_get_syspath(parent ? : ol->uddev.dev);
+	}
+
+	if (!path)
+		return NULL;
+
+	hn = htab_find(&buses, path);
+	if (hn)
+		return container_of(hn, struct out_led_bus, node);
+
+	bus = arena_alloc(sizeof(*bus));
+	bus->tail = &bus->head;
+	pthread_mutex_init(&bus->lock, NULL);
+	pthread_cond_init(&bus->cond, NULL);
+
+	ev_async_init(&bus->async, out_led_bus_async_cb);
+	ev_async_start(ev_default_loop(0), &bus->async);
+
+	err = pthread_create(&bus->thread, NULL, out_led_bus_worker, bus);
+	if (err) {
+		odev_wrn(&ol->odev, "Unable to start worker for %s, "
+			 "writing synchronously (%d)", path, -err);
+		ev_async_stop(ev_default_loop(0), &bus->async);
+		return NULL;
+	}
+
+	log_inf("(led) Started worker for %s", path);
+	htab_add(&buses, &bus->node, arena_strdup(path));
+	return bus;
+}
+
+static int out_led_read_max(struct out_led *ol)
 {
 	const char *maxstr;
+	int max;
 
 	maxstr = udev_device_get_sysattr_value(ol->uddev.dev, "max_brightness");
 	if (!maxstr)
 		goto fallback;
 
 	errno = 0;
-	ol->max_brightness = strtol(maxstr, NULL, 0);
+	max = strtol(maxstr, NULL, 0);
 	if (errno)
 		goto fallback;
 
-	return;
+	return max;
 
 fallback:
 	odev_err(&ol->odev, "Unable to read \"max_brightness\", falling back to 1");
-	ol->max_brightness = 1;
+	return 1;
+}
+
+/* Build a request that resets the writer's view of the device to its
+ * current udev state. */
+static void out_led_req_reset(struct out_led *ol, struct out_led_req *req)
+{
+	req->reset = true;
+	req->dirfd = -1;
+
+	if (!uddev_present(&ol->uddev))
+		return;
+
+	req->max_brightness = out_led_read_max(ol);
+	req->dirfd = open(udev_device_get_syspath(ol->uddev.dev),
+			  O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (req->dirfd < 0)
+		odev_err(&ol->odev, "Unable to open device (%d)", -errno);
+}
+
+/* Seed the shadow with any part of the LED's current state that
+ * matches a value used by its rules, such that a restart of the
+ * daemon does not rewrite LEDs that are already in the right state.
+ * Values are compared as strings, which is what would be written. */
+static void out_led_adopt_val(struct out_led *ol, const struct out_led_val *v)
+{
+	struct out_led_shadow *sh = &ol->hw.shadow;
+	const char *cur;
+
+	if (sh->attrs[v->attr])
+		return;
+
+	cur = udev_device_get_sysattr_value(ol->uddev.dev, g_out_led_attrs[v->attr]);
+	if (cur && strlen(cur) == v->len && !memcmp(cur, v->val, v->len))
+		sh->attrs[v->attr] = v;
+}
+
+static void out_led_adopt(struct out_led *ol, struct out_rule *rules,
+			  size_t n_rules)
+{
+	const struct out_led_action *act;
+	struct out_led_shadow *sh = &ol->hw.shadow;
+	const char *triggers, *start, *end, *cur;
+	size_t i, j;
+
+	if (ol->hw.dirfd < 0)
+		return;
+
+	/* The active trigger is the one in brackets */
+	triggers = udev_device_get_sysattr_value(ol->uddev.dev, "trigger");
+	start = triggers ? strchr(triggers, '[') : NULL;
+	end = start ? strchr(start, ']') : NULL;
+	if (!end)
+		return;
+
+	start++;
+
+	for (i = 0; i <= n_rules; i++) {
+		act = (i < n_rules) ? rules[i].priv : &out_led_default;
+		if (act->trigger.len == (size_t)(end - start) &&
+		    !memcmp(act->trigger.val, start, act->trigger.len))
+			break;
+	}
+
+	/* None of the rules use the current trigger, so it will be
+	 * written regardless. */
+	if (i > n_rules)
+		return;
+
+	sh->valid = true;
+	sh->trigger = act->trigger.val;
+
+	/* The brightness of an LED that is controlled by a trigger
+	 * follows the trigger, e.g. blinks, so it is only known when
+	 * there is none. */
+	sh->brightness = -1;
+	if (!strcmp(sh->trigger, "none")) {
+		cur = udev_device_get_sysattr_value(ol->uddev.dev, "brightness");
+		if (cur)
+			sh->brightness = strtol(cur, NULL, 0);
+	}
+
+	for (i = 0; i < n_rules; i++) {
+		act = rules[i].priv;
+		if (strcmp(act->trigger.val, sh->trigger))
+			continue;
+
+		for (j = 0; j < act->n_attrs; j++)
+			out_led_adopt_val(ol, &act->attrs[j]);
+	}
+
+	odev_dbg(&ol->odev, "Adopted trigger:%s brightness:%d",
+		 sh->trigger, sh->brightness);
 }
 
 static void out_led_uddev_cb(struct uddev *uddev, struct udev_device *dev)
 {
 	struct out_led *ol = container_of(uddev, struct out_led, uddev);
+	struct out_led_req req = { 0 };
 	const char *action;
 
 	action = udev_device_get_action(dev);
-	if (!action || strcmp(action, "add"))
+	if (!action)
+		return;
+
+	/* Drop the sysfs files of the previous instance of the
+	 * device, if any. */
+	if (!strcmp(action, "remove")) {
+		req.reset = true;
+		req.dirfd = -1;
+		out_led_submit(ol, &req);
+		return;
+	}
+
+	if (strcmp(action, "add"))
 		return;
 
 	udev_device_unref(uddev->dev);
 	uddev->dev = udev_device_ref(dev);
 
-	out_led_set_max(ol);
-
 	odev_inf(&ol->odev, "Hotplugged, applying active rule");
 
-	if (out_led_apply(&ol->odev, ol->odev.active_rule))
+	out_led_req_reset(ol, &req);
+	req.apply = true;
+	req.rule = ol->owner->active_rule;
+
+	if (out_led_submit(ol, &req))
 		odev_err(&ol->odev, "Unable to apply active rule after hotplug");
 }
 
-static int out_led_probe(const char *name, struct out_rule *rules,
-			 size_t n_rules, json_t *data)
+static void out_led_uddev_sync(struct uddev *uddev)
+{
+	struct out_led *ol = container_of(uddev, struct out_led, uddev);
+	struct out_led_req req = { 0 };
+
+	/* The active rule is reapplied by the ensuing update of all
+	 * outputs, only refresh the device specific properties. */
+	out_led_req_reset(ol, &req);
+	out_led_submit(ol, &req);
+}
+
+static int out_led_new(const char *name, struct out_dev *owner,
+		       struct out_rule *rules, size_t n_rules, int async,
+		       struct out_led **olp)
 {
+	struct out_led_req req = { 0 };
 	struct out_led *ol;
 	int err;
 
-	ol = calloc(1, sizeof(*ol));
-	if (!ol)
-		return -ENOMEM;
+	ol = arena_alloc(sizeof(*ol));
 
 	*ol = (struct out_led) {
 		.odev = {
 			.name = name,
-			.apply = out_led_apply,
-			.rules = rules,
-			.n_rules = n_rules,
 		},
+		.owner = owner ? : &ol->odev,
 		.uddev = {
 			.subsys = "leds",
 			.sysname = name,
 			.cb = out_led_uddev_cb,
+			.sync = out_led_uddev_sync,
+		},
+		.hw = {
+			.dirfd = -1,
 		},
 	};
 
 	err = uddev_init(&ol->uddev);
 	if (err)
-		goto err;
+		return err;
+
+	/* The LED is not known to any worker yet, so its initial
+	 * state can be set up from here. */
+	out_led_req_reset(ol, &req);
+	out_led_exec(ol, &req);
+	out_led_adopt(ol, rules, n_rules);
 
 	if (uddev_present(&ol->uddev))
-		out_led_set_max(ol);
+		ol->bus = out_led_bus_get(ol, async);
+
+	*olp = ol;
+	return 0;
+}
+
+/* Whether LEDs are written by a bus worker: 1 if always, 0 if never
+ * and -1 if they are attached through a slow bus. */
+static int out_led_async(const char *name, json_t *data, int *asyncp)
+{
+	json_t *async;
+
+	*asyncp = -1;
+
+	async = json_object_get(data, "async");
+	if (!async)
+		return 0;
+
+	if (!json_is_boolean(async)) {
+		log_err("(led) %s: \"async\" must be a boolean", name);
+		return -EINVAL;
+	}
+
+	*asyncp = json_is_true(async);
+	return 0;
+}
+
+static int out_led_probe(const char *name, struct out_rule *rules,
+			 size_t n_rules, json_t *data)
+{
+	struct out_led *ol;
+	int async, err;
+
+	err = out_led_async(name, data, &async);
+	if (err)
+		return err;
+
+	err = out_led_compile_rules(name, rules, n_rules);
+	if (err)
+		return err;
+
+	err = out_led_new(name, NULL, rules, n_rules, async, &ol);
+	if (err)
+		return err;
+
+	ol->odev.apply = out_led_apply;
+	ol->odev.rules = rules;
+	ol->odev.n_rules = n_rules;
 
 	out_dev_add(&ol->odev);
 	uddev_start(&ol->uddev);
 	return 0;
-
-err:
-	free(ol);
-	return err;
 }
 
 const struct out_drv out_led = {
@@ -179,76 +1042,122 @@ const struct out_drv out_led = {
 	.probe = out_led_probe,
 };
 
+/* The group's rules are evaluated once, and the resulting state is
+ * applied to all of its members. */
+static int out_led_group_apply(struct out_dev *odev, struct out_rule *rule)
+{
+	struct out_led_group *olg = container_of(odev, struct out_led_group, odev);
+	size_t i;
+	int err, ret = 0;
+
+	for (i = 0; i < olg->n_leds; i++) {
+		err = out_led_apply(&olg->leds[i]->odev, rule);
+		if (err) {
+			odev_err(&olg->leds[i]->odev, "Failed to apply state (%d)", err);
+			ret = ret ? : err;
+		}
+	}
+
+	return ret;
+}
+
 static int out_led_group_probe(const char *name, struct out_rule *rules,
 			       size_t n_rules, json_t *data)
 {
-	struct udev_enumerate *enumer;
-	struct udev_list_entry *list;
-	struct udev *udev;
-
-	size_t i, n_matches;
+	const char **patterns = NULL, **sysnames = NULL;
+	size_t i, n_patterns = 0, n_sysnames = 0;
+	struct out_led_group *olg;
+	struct out_led *ol;
 	const char *match;
 	json_t *matches;
-	int err = -EINVAL;
+	int async, err;
 
-	udev = udev_new();
-	enumer = udev_enumerate_new(udev);
-
-	if (udev_enumerate_add_match_subsystem(enumer, "leds"))
-		goto out;
+	err = out_led_async(name, data, &async);
+	if (err)
+		return err;
 
 	if (!json_unpack(data, "{s: o}", "match", &matches)) {
 		switch (json_typeof(matches)) {
 		case JSON_STRING:
-			if (udev_enumerate_add_match_sysname(enumer, json_string_value(matches)))
-				goto out;
+			n_patterns = 1;
 			break;
 		case JSON_ARRAY:
-			n_matches = json_array_size(matches);
+			n_patterns = json_array_size(matches);
+			break;
+		default:
+			goto match_error;
+		}
 
-			for (i = 0; i < n_matches; i++) {
-				match = json_string_value(json_array_get(matches, i));
-				if (!match)
-					goto match_error;
+		patterns = calloc(n_patterns, sizeof(*patterns));
+		assert(patterns);
 
-				if (udev_enumerate_add_match_sysname(enumer, match))
-					goto out;
+		if (json_is_string(matches)) {
+			patterns[0] = json_string_value(matches);
+		} else {
+			for (i = 0; i < n_patterns; i++) {
+				patterns[i] = json_string_value(json_array_get(matches, i));
+				if (!patterns[i])
+					goto match_error;
 			}
-
-			break;
-		default:
-		match_error:
-			log_err("(led-group) %s: \"match\" must be a string or list of strings",
-				name);
-			goto out;
 		}
 	} else {
-		if (udev_enumerate_add_match_sysname(enumer, name))
-			goto out;
+		patterns = calloc(1, sizeof(*patterns));
+		assert(patterns);
+
+		patterns[0] = name;
+		n_patterns = 1;
 	}
 
-	if (udev_enumerate_scan_devices(enumer))
+	err = out_led_compile_rules(name, rules, n_rules);
+	if (err)
+		goto out;
+
+	err = uddev_enum_match("leds", patterns, n_patterns, &sysnames, &n_sysnames);
+	if (err)
 		goto out;
 
-	udev_list_entry_foreach(list, udev_enumerate_get_list_entry(enumer)) {
-		match = udev_list_entry_get_name(list);
-		match = rindex(match, '/') + 1;
+	olg = arena_alloc(sizeof(*olg));
+
+	*olg = (struct out_led_group) {
+		.odev = {
+			.name = name,
+			.apply = out_led_group_apply,
+			.rules = rules,
+			.n_rules = n_rules,
+		},
+	};
+
+	olg->leds = arena_allocarray(n_sysnames, sizeof(*olg->leds));
+
+	for (i = 0; i < n_sysnames; i++) {
+		log_dbg("(led-group) %s: Found matching LED \"%s\"", name, sysnames[i]);
 
-		log_dbg("(led-group) %s: Found matching LED \"%s\"", name, match);
+		/* The enumeration is released after probing, whereas
+		 * the LED needs its name for its lifetime. */
+		match = arena_strdup(sysnames[i]);
 
-		err = out_led_probe(match, rules, n_rules, data);
+		err = out_led_new(match, &olg->odev, rules, n_rules, async, &ol);
 		if (err)
 			goto out;
+
+		olg->leds[olg->n_leds++] = ol;
 	}
 
-	err = 0;
-out:
-	if (enumer)
-		udev_enumerate_unref(enumer);
+	out_dev_add(&olg->odev);
 
-	if (udev)
-		udev_unref(udev);
+	for (i = 0; i < olg->n_leds; i++)
+		uddev_start(&olg->leds[i]->uddev);
 
+	err = 0;
+	goto out;
+
+match_error:
+	log_err("(led-group) %s: \"match\" must be a string or list of strings",
+		name);
+	err = -EINVAL;
+out:
+	free(sysnames);
+	free(patterns);
 	return err;
 }
 
@@ -1,7 +1,32 @@
+#include <stdlib.h>
+
 #include "iito.h"
 
+#define rule_fmt "\"%s%s%s\""
+#define rule_args(_rule)						\
+	!(_rule)->invert ? "" :						\
+	((_rule)->cond->op == COND_PROP ? "!" : "!("),			\
+	cond_expr((_rule)->cond),					\
+	(_rule)->invert && (_rule)->cond->op != COND_PROP ? ")" : ""
+
 static struct out_dev **g_out_devs;
 static size_t g_out_devs_n;
+static size_t g_out_devs_max;
+
+static struct out_dev **g_out_queue;
+static size_t g_out_queue_n;
+
+static struct out_dev **g_out_commit;
+static int *g_out_commit_err;
+static size_t g_out_commit_n;
+
+/* Time from the start of the first, to the end of the last, apply of
+ * each commit. */
+static struct {
+	ev_tstamp last;
+	ev_tstamp max;
+	unsigned long n;
+} g_out_skew;
 
 void out_dump(void)
 {
@@ -13,109 +38,276 @@ void out_dump(void)
 	for (i = 0, odev = g_out_devs; i < g_out_devs_n; i++, odev++) {
 		rule = (*odev)->active_rule;
 		if (rule)
-			log_not("  (out) %s: active rule: \"%s%s%s%s\"",
-				(*odev)->name,
-				rule->invert ? "!" : "",
-				rule->idev->name, rule->prop ? ":" : "",
-				rule->prop ? : "");
+			log_not("  (out) %s: active rule: " rule_fmt,
+				(*odev)->name, rule_args(rule));
 		else
 			log_not("  (out) %s: active rule: none", (*odev)->name);
 	}
+
+	log_not("Commit skew: last %.0fus, max %.0fus, over %lu commits",
+		g_out_skew.last * 1e6, g_out_skew.max * 1e6, g_out_skew.n);
 }
 
-void out_dev_add(struct out_dev *odev)
+/* Index the output from each condition that it references, so that
+ * a change only has to consider the outputs that depend on it. */
+static void out_dev_index(struct out_dev *odev)
 {
-	struct out_dev **odevs;
+	struct cond_use *uses;
+	struct out_rule *rule;
+	struct cond *cond;
+	size_t i;
 
-	odevs = reallocarray(g_out_devs, g_out_devs_n + 1, sizeof(*g_out_devs));
-	assert(odevs);
+	for (i = 0, rule = odev->rules; i < odev->n_rules; i++, rule++) {
+		cond = rule->cond;
 
-	odevs[g_out_devs_n++] = odev;
-	g_out_devs = odevs;
+		/* Only the first reference is of interest */
+		if (cond->n_uses && cond->uses[cond->n_uses - 1].odev == odev)
+			continue;
+
+		uses = reallocarray(cond->uses, cond->n_uses + 1, sizeof(*uses));
+		assert(uses);
+
+		uses[cond->n_uses++] = (struct cond_use) {
+			.odev = odev,
+			.rule = i,
+		};
+		cond->uses = uses;
+	}
 }
 
-static bool out_dev_uses(struct out_dev *odev, const struct in_dev *idev)
+#define RULE_WORDS(_n) (((_n) + 63) >> 6)
+
+/* Compile the rules to the positions of their conditions in the
+ * input state vector, so that the active rule can be determined by
+ * gathering the relevant bits into a rule vector, and finding the
+ * first set bit. */
+static void out_dev_compile(struct out_dev *odev)
 {
 	struct out_rule *rule;
 	size_t i;
 
+	odev->rbits = arena_allocarray(odev->n_rules, sizeof(*odev->rbits));
+	odev->rinv = arena_allocarray(RULE_WORDS(odev->n_rules), sizeof(*odev->rinv));
+
 	for (i = 0, rule = odev->rules; i < odev->n_rules; i++, rule++) {
-		if (rule->idev == idev)
-			return true;
+		odev->rbits[i] = rule->cond->bit;
+
+		if (rule->invert)
+			odev->rinv[i >> 6] |= 1ULL << (i & 63);
+	}
+}
+
+/* Make room for at least n outputs. out_probe() reserves room for all
+ * outputs in the config up front, so this normally only allocates
+ * once. */
+static void out_devs_reserve(size_t n)
+{
+	struct out_dev **odevs;
+
+	if (n <= g_out_devs_max)
+		return;
+
+	if (n < g_out_devs_max * 2)
+		n = g_out_devs_max * 2;
+
+	odevs = arena_allocarray(n, sizeof(*odevs));
+	if (g_out_devs_n)
+		memcpy(odevs, g_out_devs, g_out_devs_n * sizeof(*odevs));
+
+	g_out_devs = odevs;
+
+	/* The queue is always empty while probing */
+	g_out_queue = arena_allocarray(n, sizeof(*g_out_queue));
+	g_out_commit = arena_allocarray(n, sizeof(*g_out_commit));
+	g_out_commit_err = arena_allocarray(n, sizeof(*g_out_commit_err));
+	g_out_devs_max = n;
+}
+
+void out_dev_add(struct out_dev *odev)
+{
+	out_devs_reserve(g_out_devs_n + 1);
+	g_out_devs[g_out_devs_n++] = odev;
+
+	out_dev_compile(odev);
+	out_dev_index(odev);
+}
+
+
+static struct out_rule *out_eval(struct out_dev *odev, const uint64_t *state)
+{
+	size_t w, i, n, base;
+	uint64_t match;
+
+	for (w = 0; w < RULE_WORDS(odev->n_rules); w++) {
+		base = w << 6;
+		n = odev->n_rules - base;
+		if (n > 64)
+			n = 64;
+
+		match = 0;
+		for (i = 0; i < n; i++)
+			match |= (uint64_t)in_state_test(state, odev->rbits[base + i]) << i;
+
+		match ^= odev->rinv[w];
+		if (match)
+			return &odev->rules[base + ffsll(match) - 1];
 	}
 
-	return false;
+	return NULL;
 }
 
-static int out_update_one(struct out_dev *odev)
+/* Compute phase: determine the rule that an output should apply, and
+ * add it to the commit set if needed. */
+static void out_prepare(struct out_dev *odev, const uint64_t *state, bool force)
 {
 	struct out_rule *rule;
-	bool state;
+
+	rule = out_eval(odev, state);
+	if (!force && !odev->retry && rule == odev->active_rule)
+		return;
+
+	if (rule)
+		odev_dbg(odev, "Apply rule " rule_fmt, rule_args(rule));
+	else
+		odev_dbg(odev, "Apply default rule");
+
+	odev->pending_rule = rule;
+	g_out_commit[g_out_commit_n++] = odev;
+}
+
+/* Commit phase: apply all prepared outputs back-to-back, such that
+ * they change state as close together as possible, e.g. to get timer
+ * triggered LEDs to blink in unison. */
+static int out_commit(void)
+{
+	struct out_dev *odev;
+	ev_tstamp start, skew;
+	int err, ret = 0;
 	size_t i;
-	int err;
 
-	odev_dbg(odev, "Update");
+	if (!g_out_commit_n)
+		return 0;
 
-	for (i = 0, rule = odev->rules; i < odev->n_rules; i++, rule++) {
-		err = rule->idev->sample(rule->idev, rule->prop, &state);
+	start = ev_time();
+
+	for (i = 0; i < g_out_commit_n; i++) {
+		odev = g_out_commit[i];
+
+		err = odev->apply(odev, odev->pending_rule);
+		g_out_commit_err[i] = err;
 		if (err) {
-			odev_err(odev, "Failed to sample \"%s%s%s\" (%d)",
-				rule->idev->name, rule->prop ? ":" : "",
-				rule->prop ? : "", err);
-			return err;
+			ret = ret ? : err;
+		} else {
+			odev->active_rule = odev->pending_rule;
+			odev->retry = false;
 		}
+	}
 
-		if (state ^ rule->invert) {
-			odev_dbg(odev, "Apply rule \"%s%s%s%s\"",
-				rule->invert ? "!" : "",
-				rule->idev->name, rule->prop ? ":" : "",
-				rule->prop ? : "");
-
-			err = odev->apply(odev, rule);
-			if (err)
-				odev_err(odev, "Failed to apply rule \"%s%s%s%s\" (%d)",
-					rule->invert ? "!" : "",
-					rule->idev->name, rule->prop ? ":" : "",
-					rule->prop ? : "", err);
-			else
-				odev->active_rule = rule;
+	skew = ev_time() - start;
 
-			return err;
-		}
+	g_out_skew.last = skew;
+	if (skew > g_out_skew.max)
+		g_out_skew.max = skew;
+	g_out_skew.n++;
+
+	log_dbg("Committed %zu outputs in %.0fus", g_out_commit_n, skew * 1e6);
+
+	/* Report failures after the fact, to keep the commit tight */
+	for (i = 0; ret && i < g_out_commit_n; i++) {
+		odev = g_out_commit[i];
+		if (!g_out_commit_err[i])
+			continue;
+
+		if (odev->pending_rule)
+			odev_err(odev, "Failed to apply rule " rule_fmt " (%d)",
+				 rule_args(odev->pending_rule), g_out_commit_err[i]);
+		else
+			odev_err(odev, "Failed to apply default rule (%d)",
+				 g_out_commit_err[i]);
 	}
 
-	odev_dbg(odev, "Apply default rule");
+	g_out_commit_n = 0;
+	return ret;
+}
 
-	err = odev->apply(odev, NULL);
-	if (err)
-		odev_err(odev, "Failed to apply default rule (%d)", err);
-	else
-		odev->active_rule = NULL;
+static void out_dev_queue(struct out_dev *odev)
+{
+	if (odev->queued)
+		return;
+
+	odev->queued = true;
+	g_out_queue[g_out_queue_n++] = odev;
+}
+
+/* Queue the outputs that depend on a condition whose state has
+ * changed, for reevaluation by out_flush(). */
+void out_queue(struct cond *cond)
+{
+	struct cond_use *use;
+	size_t i;
+
+	for (i = 0, use = cond->uses; i < cond->n_uses; i++, use++) {
+		/* Rules are evaluated in order, so if the active rule
+		 * precedes the first one that references the
+		 * condition, it can not affect the outcome. */
+		if (use->odev->active_rule && !use->odev->retry &&
+		    (size_t)(use->odev->active_rule - use->odev->rules) < use->rule)
+			continue;
+
+		out_dev_queue(use->odev);
+	}
+}
+
+/* Called by drivers when an apply that was reported as successful
+ * has failed after the fact, e.g. on a worker thread. The output is
+ * recommitted before the event loop blocks again. */
+void out_dev_retry(struct out_dev *odev)
+{
+	odev_dbg(odev, "Failed to apply active rule, retrying");
+	odev->retry = true;
 
-	return err;
+	out_dev_queue(odev);
+	in_flush_schedule();
 }
 
-int out_update(const struct in_dev *filter)
+int out_flush(void)
 {
+	const uint64_t *state = in_state();
+	size_t i;
+
+	if (!g_out_queue_n)
+		return 0;
+
+	log_dbg("Update %zu outputs", g_out_queue_n);
+
+	for (i = 0; i < g_out_queue_n; i++) {
+		g_out_queue[i]->queued = false;
+		out_prepare(g_out_queue[i], state, false);
+	}
+
+	g_out_queue_n = 0;
+	return out_commit();
+}
+
+int out_update(void)
+{
+	const uint64_t *state = in_state();
 	struct out_dev **odev;
 	size_t i;
 	int err;
 
-	if (filter)
-		log_dbg("Update outputs related to \"%s\"", filter->name);
-	else
-		log_dbg("Update all outputs");
+	log_dbg("Update all outputs");
 
-	for (i = 0, odev = g_out_devs; i < g_out_devs_n; i++, odev++) {
-		if (filter && !out_dev_uses(*odev, filter))
-			continue;
+	/* Inputs that fail to be sampled keep their last known state,
+	 * which must not hold back the update of the others */
+	err = in_refresh();
 
-		err = out_update_one(*odev);
-		if (err)
-			return err;
-	}
+	cond_refresh();
 
-	return 0;
+	for (i = 0, odev = g_out_devs; i < g_out_devs_n; i++, odev++)
+		out_prepare(*odev, state, true);
+
+	return out_commit() ? : err;
 }
 
 
@@ -131,11 +323,11 @@ static const struct out_drv *out_drvs[] = {
 
 static int out_probe_rule(json_t *data, struct out_rule *rule)
 {
-	const char *devprop;
+	const char *expr;
 	int err;
 
 	err = json_unpack(data, "{s:s, s:o}",
-			  "if", &devprop,
+			  "if", &expr,
 			  "then", &rule->state);
 	if (err)
 		return err;
@@ -144,12 +336,7 @@ static int out_probe_rule(json_t *data, struct out_rule *rule)
 	if (err)
 		return err;
 
-	if (devprop[0] == '!') {
-		rule->invert = true;
-		devprop++;
-	}
-
-	return in_dev_find(devprop, &rule->idev, &rule->prop);
+	return cond_parse(expr, &rule->cond, &rule->invert);
 }
 
 static int out_probe_rules(json_t *dev, struct out_rule **rulesp, size_t *n_rulesp)
@@ -167,15 +354,12 @@ static int out_probe_rules(json_t *dev, struct out_rule **rulesp, size_t *n_rule
 		return -EINVAL;
 
 	rarr_size = json_array_size(rarr);
-	rules = calloc(rarr_size, sizeof(*rules));
-	assert(rules);
+	rules = arena_allocarray(rarr_size, sizeof(*rules));
 
 	for (i = 0; i < rarr_size; i++) {
 		err = out_probe_rule(json_array_get(rarr, i), &rules[i]);
-		if (err) {
-			free(rules);
+		if (err)
 			return err;
-		}
 	}
 
 	*rulesp = rules;
@@ -204,6 +388,9 @@ static int out_probe_drv(const char *drvname, json_t *devs)
 	json_object_foreach(devs, name, data) {
 		log_dbg("Probing %s output \"%s\"", drvname, name);
 
+		/* The config is released after probing */
+		name = arena_strdup(name);
+
 		err = out_probe_rules(data, &rules, &n_rules);
 		if (err) {
 			log_err("Failed parsing rules of %s output \"%s\" (%d)",
@@ -224,16 +411,24 @@ static int out_probe_drv(const char *drvname, json_t *devs)
 
 int out_probe(json_t *outs)
 {
+	ev_tstamp start = ev_time();
 	const char *name;
 	json_t *devs;
+	size_t n = 0;
 	int err;
 
+	json_object_foreach(outs, name, devs)
+		n += json_object_size(devs);
+
+	out_devs_reserve(n);
+
 	json_object_foreach(outs, name, devs) {
 		err = out_probe_drv(name, devs);
 		if (err)
 			return err;
 	}
 
-	log_not("Successfully probed %zu outputs", g_out_devs_n);
+	log_not("Successfully probed %zu outputs in %.1fms", g_out_devs_n,
+		(ev_time() - start) * 1000.);
 	return 0;
 }
@@ -0,0 +1,405 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "iito.h"
+
+#define PWATCH_ADDED   (IN_CREATE | IN_MOVED_TO)
+#define PWATCH_REMOVED (IN_DELETE | IN_MOVED_FROM)
+
+#define PWATCH_MASK (PWATCH_ADDED | PWATCH_REMOVED | \
+		     IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* A directory that either holds watched paths, or is an ancestor of
+ * one that does. Only directories that are needed are watched: those
+ * holding watched paths and, for as long as a descendant is missing,
+ * the nearest ancestor that exists, such that its creation is
+ * noticed without polling. Once watched, a directory stays watched
+ * until it is removed. */
+struct pwatch_dir {
+	struct hnode node;
+	const char *path;
+	int wd;
+	uint32_t mask;
+	struct pwatch_dir *wd_next;
+
+	struct pwatch_dir *parent;
+	struct hnode entry;
+
+	/* Watched paths and subdirectories, by name */
+	struct htab files;
+	struct htab subdirs;
+};
+
+/* All paths share a single inotify instance, with one watch per
+ * directory. Events are looked up by watch descriptor, and then
+ * dispatched by name to the paths in that directory, so no path ever
+ * needs to be stat()ed after it has been added. */
+static struct {
+	int fd;
+	struct ev_io io;
+
+	struct htab dirs;
+
+	/* Watched directories, by watch descriptor */
+	struct pwatch_dir **wds;
+	size_t n_wd_bkts;
+	size_t n_wds;
+} g_pwatch = {
+	.fd = -1,
+};
+
+static void pwatch_set(struct pwatch *pw, bool present, bool modified)
+{
+	if (pw->present == present && !modified)
+		return;
+
+	pw->present = present;
+	pw->cb(pw);
+}
+
+static void pwatch_wd_grow(void)
+{
+	struct pwatch_dir **bkts, *d, *next;
+	size_t i, n_bkts;
+
+	n_bkts = g_pwatch.n_wd_bkts ? g_pwatch.n_wd_bkts << 1 : 16;
+
+	bkts = calloc(n_bkts, sizeof(*bkts));
+	assert(bkts);
+
+	for (i = 0; i < g_pwatch.n_wd_bkts; i++) {
+		for (d = g_pwatch.wds[i]; d; d = next) {
+			next = d->wd_next;
+			d->wd_next = bkts[d->wd & (n_bkts - 1)];
+			bkts[d->wd & (n_bkts - 1)] = d;
+		}
+	}
+
+	free(g_pwatch.wds);
+	g_pwatch.wds = bkts;
+	g_pwatch.n_wd_bkts = n_bkts;
+}
+
+static void pwatch_wd_add(struct pwatch_dir *d)
+{
+	struct pwatch_dir **bkt;
+
+	if (g_pwatch.n_wds >= g_pwatch.n_wd_bkts)
+		pwatch_wd_grow();
+
+	bkt = &g_pwatch.wds[d->wd & (g_pwatch.n_wd_bkts - 1)];
+	d->wd_next = *bkt;
+	*bkt = d;
+	g_pwatch.n_wds++;
+}
+
+static void pwatch_wd_del(struct pwatch_dir *d)
+{
+	struct pwatch_dir **dp;
+
+	for (dp = &g_pwatch.wds[d->wd & (g_pwatch.n_wd_bkts - 1)]; *dp != d;
+	     dp = &(*dp)->wd_next);
+
+	*dp = d->wd_next;
+	g_pwatch.n_wds--;
+}
+
+static struct pwatch_dir *pwatch_wd_find(int wd)
+{
+	struct pwatch_dir *d;
+
+	if (!g_pwatch.n_wds)
+		return NULL;
+
+	for (d = g_pwatch.wds[wd & (g_pwatch.n_wd_bkts - 1)]; d; d = d->wd_next)
+		if (d->wd == wd)
+			return d;
+
+	return NULL;
+}
+
+static void pwatch_dir_arm(struct pwatch_dir *d);
+
+/* Resync the state of a directory's contents after it has been
+ * (re)watched. */
+static void pwatch_dir_scan(struct pwatch_dir *d)
+{
+	struct pwatch *pw;
+	struct hnode *hn;
+	struct stat st;
+	size_t i;
+
+	htab_foreach(&d->files, i, hn) {
+		pw = container_of(hn, struct pwatch, node);
+		pwatch_set(pw, !lstat(pw->path, &st), !!pw->modify);
+	}
+
+	htab_foreach(&d->subdirs, i, hn)
+		pwatch_dir_arm(container_of(hn, struct pwatch_dir, entry));
+}
+
+static void pwatch_dir_arm(struct pwatch_dir *d)
+{
+	if (d->wd >= 0)
+		return;
+
+	d->wd = inotify_add_watch(g_pwatch.fd, d->path, d->mask);
+	if (d->wd >= 0) {
+		log_dbg("(pwatch) Watching %s", d->path);
+		pwatch_wd_add(d);
+		pwatch_dir_scan(d);
+		return;
+	}
+
+	if (errno != ENOENT && errno != ENOTDIR)
+		log_wrn("(pwatch) Unable to watch %s (%d)", d->path, -errno);
+
+	/* Wait for it to show up. Arming the parent scans it, which
+	 * retries this directory, closing the window in which it
+	 * could have been created unnoticed. */
+	if (d->parent)
+		pwatch_dir_arm(d->parent);
+}
+
+/* The directory is gone, along with everything below it */
+static void pwatch_dir_lost(struct pwatch_dir *d)
+{
+	struct hnode *hn;
+	size_t i;
+
+	if (d->wd >= 0) {
+		log_dbg("(pwatch) Lost %s", d->path);
+
+		/* May already have been removed by the kernel */
+		inotify_rm_watch(g_pwatch.fd, d->wd);
+		pwatch_wd_del(d);
+		d->wd = -1;
+	}
+
+	htab_foreach(&d->files, i, hn)
+		pwatch_set(container_of(hn, struct pwatch, node), false, false);
+
+	htab_foreach(&d->subdirs, i, hn)
+		pwatch_dir_lost(container_of(hn, struct pwatch_dir, entry));
+}
+
+/* Update the watch of a directory to its current mask. Returns false
+ * if the directory has been removed or replaced since it was watched,
+ * in which case it is rewatched from scratch. */
+static bool pwatch_dir_rewatch(struct pwatch_dir *d)
+{
+	int wd;
+
+	/* Watching the same inode again yields the same wd */
+	wd = inotify_add_watch(g_pwatch.fd, d->path, d->mask);
+	if (wd == d->wd)
+		return true;
+
+	if (wd >= 0)
+		inotify_rm_watch(g_pwatch.fd, wd);
+
+	pwatch_dir_lost(d);
+	pwatch_dir_arm(d);
+	return false;
+}
+
+/* Events have been dropped. Directories that have been replaced are
+ * rewatched, and the contents of all of them are rescanned. */
+static void pwatch_rescan(void)
+{
+	struct pwatch_dir *d;
+	struct hnode *hn;
+	size_t i;
+
+	log_wrn("(pwatch) Event queue overflow, rescanning");
+
+	htab_foreach(&g_pwatch.dirs, i, hn) {
+		d = container_of(hn, struct pwatch_dir, node);
+		if (d->wd >= 0 && pwatch_dir_rewatch(d))
+			pwatch_dir_scan(d);
+	}
+}
+
+static void pwatch_event(const struct inotify_event *ev)
+{
+	struct pwatch_dir *d, *sub;
+	struct pwatch *pw;
+	struct hnode *hn;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		pwatch_rescan();
+		return;
+	}
+
+	d = pwatch_wd_find(ev->wd);
+	if (!d)
+		return;
+
+	if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)) {
+		pwatch_dir_lost(d);
+		pwatch_dir_arm(d);
+		return;
+	}
+
+	if (!ev->len)
+		return;
+
+	/* Replacing a file also modifies its contents */
+	htab_foreach_key(&d->files, ev->name, hn) {
+		pw = container_of(hn, struct pwatch, node);
+
+		if (ev->mask & PWATCH_REMOVED)
+			pwatch_set(pw, false, false);
+		else if (ev->mask & (PWATCH_ADDED | pw->modify))
+			pwatch_set(pw, true, !!pw->modify);
+	}
+
+	htab_foreach_key(&d->subdirs, ev->name, hn) {
+		sub = container_of(hn, struct pwatch_dir, entry);
+
+		if (ev->mask & PWATCH_ADDED)
+			pwatch_dir_arm(sub);
+		else if (ev->mask & PWATCH_REMOVED)
+			pwatch_dir_lost(sub);
+	}
+}
+
+static void pwatch_io_cb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+	char buf[0x1000] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	for (;;) {
+		len = read(g_pwatch.fd, buf, sizeof(buf));
+		if (len <= 0)
+			break;
+
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			pwatch_event(ev);
+		}
+	}
+
+	if (len < 0 && errno != EAGAIN)
+		log_err("(pwatch) Unable to read events (%d)", -errno);
+}
+
+static int pwatch_init(void)
+{
+	g_pwatch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (g_pwatch.fd < 0) {
+		log_err("(pwatch) Unable to create inotify instance (%d)", -errno);
+		return -errno;
+	}
+
+	ev_io_init(&g_pwatch.io, pwatch_io_cb, g_pwatch.fd, EV_READ);
+	ev_io_start(ev_default_loop(0), &g_pwatch.io);
+	return 0;
+}
+
+static struct pwatch_dir *pwatch_dir_get(const char *path, size_t len)
+{
+	struct pwatch_dir *d;
+	struct hnode *hn;
+	const char *name;
+	char *key;
+
+	key = strndup(path, len);
+	assert(key);
+
+	hn = htab_find(&g_pwatch.dirs, key);
+	if (hn) {
+		free(key);
+		return container_of(hn, struct pwatch_dir, node);
+	}
+
+	d = arena_alloc(sizeof(*d));
+	d->path = arena_strdup(key);
+	d->wd = -1;
+	d->mask = PWATCH_MASK;
+	free(key);
+
+	htab_add(&g_pwatch.dirs, &d->node, d->path);
+
+	if (strcmp(d->path, "/")) {
+		name = strrchr(d->path, '/');
+		d->parent = pwatch_dir_get(d->path,
+					   (name == d->path) ? 1 : name - d->path);
+		htab_add(&d->parent->subdirs, &d->entry, name + 1);
+	}
+
+	return d;
+}
+
+/* Make the path absolute, without any repeated or trailing slashes,
+ * so that it can be split into its components by name. */
+static const char *pwatch_path_normalize(const char *path)
+{
+	char *buf, *out, cwd[PATH_MAX];
+	const char *in, *norm;
+
+	if (path[0] != '/') {
+		if (!getcwd(cwd, sizeof(cwd)))
+			return NULL;
+	} else {
+		cwd[0] = '\0';
+	}
+
+	buf = malloc(strlen(cwd) + strlen(path) + 2);
+	assert(buf);
+
+	sprintf(buf, "%s/%s", cwd, path);
+
+	for (in = out = buf; *in; in++)
+		if (*in != '/' || out == buf || out[-1] != '/')
+			*out++ = *in;
+
+	if (out > buf + 1 && out[-1] == '/')
+		out--;
+
+	*out = '\0';
+
+	norm = arena_strdup(buf);
+	free(buf);
+	return norm;
+}
+
+int pwatch_add(struct pwatch *pw)
+{
+	struct pwatch_dir *d;
+	const char *name;
+	struct stat st;
+	int err;
+
+	pw->path = pwatch_path_normalize(pw->path);
+	if (!pw->path || !strcmp(pw->path, "/"))
+		return -EINVAL;
+
+	if (g_pwatch.fd < 0) {
+		err = pwatch_init();
+		if (err)
+			return err;
+	}
+
+	name = strrchr(pw->path, '/');
+	d = pwatch_dir_get(pw->path, (name == pw->path) ? 1 : name - pw->path);
+
+	/* Only directories holding paths whose contents are watched
+	 * report modifications */
+	if ((pw->modify & d->mask) != pw->modify) {
+		d->mask |= pw->modify;
+
+		if (d->wd >= 0 && !pwatch_dir_rewatch(d))
+			log_dbg("(pwatch) Rewatched %s", d->path);
+	}
+
+	/* The initial state is not reported */
+	pwatch_dir_arm(d);
+	htab_add(&d->files, &pw->node, name + 1);
+	pw->present = (d->wd >= 0) && !lstat(pw->path, &st);
+	return 0;
+}
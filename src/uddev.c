@@ -1,4 +1,8 @@
-#include <stdarg.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include <linux/filter.h>
 
 #include "iito.h"
 
@@ -24,106 +28,639 @@ bool uddev_present(struct uddev *uddev)
 	return !!strcmp(action, "remove");
 }
 
-int uddev_set_sysfs(struct uddev *uddev, const char *attr, const char *fmt, ...)
+/* All uddevs share a single udev context and kernel uevent
+ * monitor. Incoming events are dispatched to the interested uddevs by
+ * looking them up by sysname, rather than having every uddev receive
+ * and discard every event of its subsystem. */
+static struct {
+	struct udev *ud;
+	struct udev_monitor *mon;
+	struct ev_io ev;
+	struct ev_prepare sync;
+	bool started;
+
+	size_t rcvbuf_n;
+	bool resync;
+	size_t overruns;
+
+	const char **subsyss;
+	size_t n_subsyss;
+
+	struct htab uddevs;
+
+	bool kfilter;
+	struct htab devpaths;
+} g_mon;
+
+/* kfilter: Optionally, attach a socket filter to the monitor that
+ * lets the kernel drop uevents from devices that we do not track.
+ *
+ * A kernel uevent starts with a "<ACTION>@<DEVPATH>\0" header. Since
+ * a classic BPF program can not scan for the end of the DEVPATH, it
+ * is matched against the DEVPATHs that we have seen our devices
+ * appear at. The sysname of a device that has never been present can
+ * only be known once it is added (or moved), so all add and move
+ * events are accepted. Once such an event is received for one of our
+ * devices, its DEVPATH is added to the set and the filter is
+ * regenerated. */
+
+struct uddev_devpath {
+	struct hnode node;
+	size_t len;
+};
+
+#define BPF_JEQ_K(_k, _jt, _jf) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, _k, _jt, _jf)
+
+static int uddev_devpath_cmp(const void *_a, const void *_b)
 {
-	char val[0x100];
-	va_list ap;
-	int err;
+	const struct uddev_devpath * const *a = _a, * const *b = _b;
 
-	if (!uddev_present(uddev))
-		return -EINVAL;
+	return ((*a)->len > (*b)->len) - ((*a)->len < (*b)->len);
+}
 
-	va_start(ap, fmt);
-	vsnprintf(val, sizeof(val), fmt, ap);
-	va_end(ap);
+static size_t uddev_kfilter_chunk(size_t left)
+{
+	return left >= 4 ? 4 : (left >= 2 ? 2 : 1);
+}
 
-	err = udev_device_set_sysattr_value(uddev->dev, attr, val);
-	if (err) {
-		uddev_err(uddev, "Unable to set \"%s\" to \"%s\" (%d)", attr, val, err);
+/* Generate a block that accepts the message if the DEVPATH in the
+ * header (located at X) matches dp, and that otherwise falls through
+ * to the next instruction after it. */
+static size_t uddev_kfilter_gen_devpath(struct sock_filter *insn, size_t room,
+					const struct uddev_devpath *dp)
+{
+	const unsigned char *p = (const unsigned char *)dp->node.key;
+	size_t i, n, chunk, end;
+	uint32_t val;
+
+	/* Two instructions per chunk (including the terminating NUL),
+	 * plus the final accept */
+	for (i = 0, end = 1; i <= dp->len; i += chunk, end += 2)
+		chunk = uddev_kfilter_chunk(dp->len + 1 - i);
+
+	/* Jump offsets are limited to 8 bits */
+	if (end > room || end > 0x100)
+		return 0;
+
+	for (i = 0, n = 0; i <= dp->len; i += chunk, n += 2) {
+		chunk = uddev_kfilter_chunk(dp->len + 1 - i);
+
+		switch (chunk) {
+		case 4:
+			val = p[i] << 24 | p[i + 1] << 16 | p[i + 2] << 8 | p[i + 3];
+			insn[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_IND, i);
+			break;
+		case 2:
+			val = p[i] << 8 | p[i + 1];
+			insn[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_IND, i);
+			break;
+		default:
+			val = p[i];
+			insn[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_IND, i);
+			break;
+		}
+
+		insn[n + 1] = (struct sock_filter)BPF_JEQ_K(val, 0, end - n - 2);
+	}
+
+	insn[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+	return n;
+}
+
+static int uddev_kfilter_gen(struct sock_fprog *prog)
+{
+	static const struct sock_filter prologue[] = {
+		/* add@ */
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 3),
+		BPF_JEQ_K('@', 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+
+		/* move@, bind@ */
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 4),
+		BPF_JEQ_K('@', 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+
+		/* remove@, change@, online@, unbind@ */
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+		BPF_JEQ_K('@', 0, 2),
+		BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, 7),
+		BPF_JUMP(BPF_JMP | BPF_JA, 4, 0, 0),
+
+		/* offline@ */
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 7),
+		BPF_JEQ_K('@', 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+		BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, 8),
+	};
+	struct uddev_devpath **dps;
+	struct sock_filter *insn;
+	struct hnode *hn;
+	size_t i, n, len;
+	int err = 0;
+
+	dps = calloc(g_mon.devpaths.n, sizeof(*dps));
+	insn = calloc(BPF_MAXINSNS, sizeof(*insn));
+	assert(dps && insn);
+
+	n = 0;
+	htab_foreach(&g_mon.devpaths, i, hn)
+		dps[n++] = container_of(hn, struct uddev_devpath, node);
+
+	/* If a DEVPATH extends past the end of the message, the
+	 * program is aborted, dropping the message. By testing the
+	 * shortest paths first, any path that could still match is
+	 * guaranteed to have been tested by then. */
+	qsort(dps, n, sizeof(*dps), uddev_devpath_cmp);
+
+	memcpy(insn, prologue, sizeof(prologue));
+	n = sizeof(prologue) / sizeof(prologue[0]);
+
+	for (i = 0; i < g_mon.devpaths.n; i++) {
+		/* Leave room for the final reject */
+		len = uddev_kfilter_gen_devpath(&insn[n], BPF_MAXINSNS - n - 1, dps[i]);
+		if (!len) {
+			free(insn);
+			err = -E2BIG;
+			goto out;
+		}
+
+		n += len;
 	}
+
+	insn[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	prog->filter = insn;
+	prog->len = n;
+out:
+	free(dps);
 	return err;
 }
 
-static void uddev_ev_cb(struct ev_loop *loop, struct ev_io *ev, int revents)
+static void uddev_kfilter_update(void)
+{
+	struct sock_fprog prog;
+	int fd, err;
+
+	fd = udev_monitor_get_fd(g_mon.mon);
+
+	err = uddev_kfilter_gen(&prog);
+	if (err) {
+		log_wrn("(udev) Too many devices for kernel filter, "
+			"falling back to userspace filtering");
+
+		setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+		return;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)))
+		log_err("(udev) Unable to attach kernel filter: %m");
+	else
+		log_dbg("(udev) Attached kernel filter matching %zu devpaths (%u insns)",
+			g_mon.devpaths.n, prog.len);
+
+	free(prog.filter);
+}
+
+static void uddev_kfilter_track(struct udev_device *dev)
+{
+	struct uddev_devpath *dp;
+	const char *devpath;
+
+	devpath = udev_device_get_devpath(dev);
+	if (!devpath || htab_find(&g_mon.devpaths, devpath))
+		return;
+
+	dp = calloc(1, sizeof(*dp));
+	assert(dp);
+
+	dp->len = strlen(devpath);
+	devpath = strdup(devpath);
+	assert(devpath);
+
+	htab_add(&g_mon.devpaths, &dp->node, devpath);
+
+	ev_prepare_start(ev_default_loop(0), &g_mon.sync);
+}
+
+void uddev_kfilter(bool enable)
+{
+	g_mon.kfilter = enable;
+}
+
+/* Size the receive buffer to be able to hold a burst of events for
+ * all tracked devices, e.g. when a line card is inserted. */
+#define UDDEV_RCVBUF_MIN     (1 << 20)
+#define UDDEV_RCVBUF_PER_DEV (16 << 10)
+
+static void uddev_rcvbuf_update(void)
 {
-	struct uddev *uddev = container_of(ev, struct uddev, ev);
+	size_t size;
+
+	if (g_mon.rcvbuf_n == g_mon.uddevs.n)
+		return;
+
+	g_mon.rcvbuf_n = g_mon.uddevs.n;
+
+	size = UDDEV_RCVBUF_MIN + g_mon.uddevs.n * UDDEV_RCVBUF_PER_DEV;
+	if (size > INT_MAX)
+		size = INT_MAX;
+
+	if (udev_monitor_set_receive_buffer_size(g_mon.mon, size))
+		log_wrn("(udev) Unable to set receive buffer size to %zu", size);
+}
+
+/* When the receive buffer overruns, there is no telling which events
+ * were lost. Rebuild the state of all tracked devices from a single
+ * scan, and then reevaluate all outputs in one go. */
+static void uddev_resync(void)
+{
+	struct udev_enumerate *enumer;
+	struct udev_list_entry *list;
 	struct udev_device *dev;
 	const char *sysname;
+	struct uddev *uddev;
+	struct hnode *hn;
+	size_t i;
+
+	g_mon.resync = false;
+
+	enumer = udev_enumerate_new(g_mon.ud);
+	if (!enumer)
+		goto err;
+
+	for (i = 0; i < g_mon.n_subsyss; i++)
+		if (udev_enumerate_add_match_subsystem(enumer, g_mon.subsyss[i]))
+			goto err;
+
+	if (udev_enumerate_scan_devices(enumer))
+		goto err;
+
+	htab_foreach(&g_mon.uddevs, i, hn)
+		container_of(hn, struct uddev, node)->stale = true;
+
+	udev_list_entry_foreach(list, udev_enumerate_get_list_entry(enumer)) {
+		sysname = rindex(udev_list_entry_get_name(list), '/') + 1;
+
+		dev = NULL;
+		htab_foreach_key(&g_mon.uddevs, sysname, hn) {
+			uddev = container_of(hn, struct uddev, node);
+
+			if (!dev) {
+				dev = udev_device_new_from_syspath(g_mon.ud,
+								   udev_list_entry_get_name(list));
+				if (!dev)
+					break;
+			}
+
+			if (strcmp(uddev->subsys, udev_device_get_subsystem(dev) ? : ""))
+				continue;
+
+			if (uddev->dev)
+				udev_device_unref(uddev->dev);
+
+			uddev->dev = udev_device_ref(dev);
+			uddev->stale = false;
+
+			if (g_mon.kfilter)
+				uddev_kfilter_track(dev);
+		}
+
+		if (dev)
+			udev_device_unref(dev);
+	}
+
+	htab_foreach(&g_mon.uddevs, i, hn) {
+		uddev = container_of(hn, struct uddev, node);
+
+		if (uddev->stale && uddev->dev) {
+			udev_device_unref(uddev->dev);
+			uddev->dev = NULL;
+		}
+
+		if (uddev->sync)
+			uddev->sync(uddev);
+	}
+
+	udev_enumerate_unref(enumer);
+
+	if (out_update())
+		log_err("(udev) Unable to update outputs after resync");
+
+	return;
+
+err:
+	log_err("(udev) Unable to rescan devices after overrun");
+
+	if (enumer)
+		udev_enumerate_unref(enumer);
+}
+
+static void uddev_sync_cb(struct ev_loop *loop, struct ev_prepare *w, int revents)
+{
+	ev_prepare_stop(loop, w);
+
+	uddev_rcvbuf_update();
 
-	dev = udev_monitor_receive_device(uddev->mon);
-	if (!dev)
+	if (g_mon.resync)
+		uddev_resync();
+
+	if (g_mon.kfilter)
+		uddev_kfilter_update();
+}
+
+void uddev_dump(void)
+{
+	log_not("udev status:");
+	log_not("  (udev) tracking %zu devices, %zu receive overruns",
+		g_mon.uddevs.n, g_mon.overruns);
+}
+
+static void uddev_ev_cb(struct ev_loop *loop, struct ev_io *ev, int revents)
+{
+	const char *sysname, *subsys;
+	struct udev_device *dev;
+	struct uddev *uddev;
+	struct hnode *hn;
+
+	dev = udev_monitor_receive_device(g_mon.mon);
+	if (!dev) {
+		if (errno != ENOBUFS)
+			return;
+
+		g_mon.overruns++;
+		if (!g_mon.resync)
+			log_wrn("(udev) Receive buffer overrun, resynchronizing");
+
+		g_mon.resync = true;
+		ev_prepare_start(loop, &g_mon.sync);
 		return;
+	}
 
 	sysname = udev_device_get_sysname(dev);
-	if (!sysname || strcmp(sysname, uddev->sysname)) {
-		uddev_dbg(uddev, "Ignoring unrelated event from \"%s\"", sysname);
-		udev_device_unref(dev);
-		return;
+	subsys = udev_device_get_subsystem(dev);
+	if (!sysname || !subsys)
+		goto out;
+
+	htab_foreach_key(&g_mon.uddevs, sysname, hn) {
+		uddev = container_of(hn, struct uddev, node);
+		if (strcmp(uddev->subsys, subsys))
+			continue;
+
+		uddev->cb(uddev, dev);
+
+		if (uddev->dev)
+			udev_device_unref(uddev->dev);
+
+		uddev->dev = udev_device_ref(dev);
+
+		if (g_mon.kfilter)
+			uddev_kfilter_track(dev);
 	}
 
-	uddev->cb(uddev, dev);
+out:
+	udev_device_unref(dev);
+}
+
+static int uddev_mon_init(void)
+{
+	if (g_mon.mon)
+		return 0;
 
-	if (uddev->dev)
-		udev_device_unref(uddev->dev);
+	g_mon.ud = udev_new();
+	if (!g_mon.ud) {
+		log_err("(udev) Unable to create udev context");
+		return -ENOSYS;
+	}
+
+	g_mon.mon = udev_monitor_new_from_netlink(g_mon.ud, "kernel");
+	if (!g_mon.mon) {
+		log_err("(udev) Unable to setup udev monitor");
+		udev_unref(g_mon.ud);
+		g_mon.ud = NULL;
+		return -ENOSYS;
+	}
 
-	uddev->dev = dev;
+	ev_io_init(&g_mon.ev, uddev_ev_cb, udev_monitor_get_fd(g_mon.mon), EV_READ);
+	ev_prepare_init(&g_mon.sync, uddev_sync_cb);
+	return 0;
 }
 
-int uddev_start(struct uddev *uddev)
+static int uddev_mon_add_subsys(const char *subsys)
 {
-	ev_io_start(ev_default_loop(0), &uddev->ev);
+	const char **subsyss;
+	size_t i;
 
-	if (udev_monitor_enable_receiving(uddev->mon)) {
-		uddev_err(uddev, "Unable to start monitor");
-		return -EINVAL;
+	for (i = 0; i < g_mon.n_subsyss; i++)
+		if (!strcmp(g_mon.subsyss[i], subsys))
+			return 0;
+
+	if (udev_monitor_filter_add_match_subsystem_devtype(g_mon.mon, subsys, NULL))
+		return -ENOSYS;
+
+	/* Filters added after the monitor is started only take
+	 * effect after an explicit update, which also replaces any
+	 * socket filter that we have attached. */
+	if (g_mon.started) {
+		if (udev_monitor_filter_update(g_mon.mon))
+			return -ENOSYS;
+
+		ev_prepare_start(ev_default_loop(0), &g_mon.sync);
 	}
 
+	subsyss = reallocarray(g_mon.subsyss, g_mon.n_subsyss + 1,
+			       sizeof(*g_mon.subsyss));
+	assert(subsyss);
+
+	subsyss[g_mon.n_subsyss++] = subsys;
+	g_mon.subsyss = subsyss;
 	return 0;
 }
 
-int uddev_init(struct uddev *uddev)
+/* enum: At probe time, every referenced subsystem is enumerated once,
+ * and all devices are then resolved from the resulting table, rather
+ * than having each lookup walk sysfs on its own. */
+
+struct uddev_ent {
+	struct hnode node;
+	const char *subsys;
+	char *syspath;
+};
+
+struct uddev_enum {
+	const char *subsys;
+	const char **sysnames;
+	size_t n_sysnames;
+};
+
+static struct {
+	struct uddev_enum *enums;
+	size_t n_enums;
+
+	struct htab ents;
+} g_enum;
+
+static struct uddev_enum *uddev_enum_scan(const char *subsys)
 {
-	int err;
+	struct udev_enumerate *enumer;
+	struct udev_list_entry *list;
+	struct uddev_enum *ue;
+	struct uddev_ent *ent;
+	size_t i;
 
-	uddev->ud = udev_new();
-	if (!uddev->ud) {
-		uddev_err(uddev, "Unable to create udev context");
-		err = -ENOSYS;
-		goto err;
+	for (i = 0, ue = g_enum.enums; i < g_enum.n_enums; i++, ue++)
+		if (!strcmp(ue->subsys, subsys))
+			return ue;
+
+	if (uddev_mon_init())
+		return NULL;
+
+	enumer = udev_enumerate_new(g_mon.ud);
+	if (!enumer)
+		return NULL;
+
+	if (udev_enumerate_add_match_subsystem(enumer, subsys) ||
+	    udev_enumerate_scan_devices(enumer)) {
+		udev_enumerate_unref(enumer);
+		return NULL;
 	}
 
-	uddev->dev = udev_device_new_from_subsystem_sysname(uddev->ud,
-							    uddev->subsys,
-							    uddev->sysname);
-	if (!uddev->dev)
-		uddev_dbg(uddev, "Not available");
+	ue = reallocarray(g_enum.enums, g_enum.n_enums + 1, sizeof(*ue));
+	assert(ue);
+	g_enum.enums = ue;
 
-	uddev->mon = udev_monitor_new_from_netlink(uddev->ud, "kernel");
-	if (!uddev->mon) {
-		uddev_err(uddev, "Unable to setup udev monitor");
-		err = -ENOSYS;
-		goto err;
+	ue = &g_enum.enums[g_enum.n_enums++];
+	*ue = (struct uddev_enum) { .subsys = subsys };
+
+	udev_list_entry_foreach(list, udev_enumerate_get_list_entry(enumer)) {
+		ent = calloc(1, sizeof(*ent));
+		assert(ent);
+
+		ent->subsys = subsys;
+		ent->syspath = strdup(udev_list_entry_get_name(list));
+		assert(ent->syspath);
+
+		htab_add(&g_enum.ents, &ent->node, rindex(ent->syspath, '/') + 1);
+
+		ue->sysnames = reallocarray(ue->sysnames, ue->n_sysnames + 1,
+					    sizeof(*ue->sysnames));
+		assert(ue->sysnames);
+		ue->sysnames[ue->n_sysnames++] = ent->node.key;
 	}
 
-	if (udev_monitor_filter_add_match_subsystem_devtype(uddev->mon,
-							    uddev->subsys, NULL)) {
-		uddev_err(uddev, "Unable to apply subsystem filter");
-		err = -ENOSYS;
-		goto err;
+	udev_enumerate_unref(enumer);
+
+	log_dbg("(udev) Enumerated %zu devices in subsystem \"%s\"",
+		ue->n_sysnames, subsys);
+	return ue;
+}
+
+static struct udev_device *uddev_enum_get(const char *subsys, const char *sysname)
+{
+	struct uddev_ent *ent;
+	struct hnode *hn;
+
+	if (!uddev_enum_scan(subsys))
+		return udev_device_new_from_subsystem_sysname(g_mon.ud, subsys, sysname);
+
+	htab_foreach_key(&g_enum.ents, sysname, hn) {
+		ent = container_of(hn, struct uddev_ent, node);
+		if (!strcmp(ent->subsys, subsys))
+			return udev_device_new_from_syspath(g_mon.ud, ent->syspath);
+	}
+
+	return NULL;
+}
+
+/* Collect the sysnames of all devices in subsys that match any of the
+ * shell wildcard patterns. */
+int uddev_enum_match(const char *subsys, const char **patterns, size_t n_patterns,
+		     const char ***sysnamesp, size_t *np)
+{
+	struct uddev_enum *ue;
+	size_t i, j;
+
+	ue = uddev_enum_scan(subsys);
+	if (!ue)
+		return -ENOSYS;
+
+	for (i = 0; i < ue->n_sysnames; i++) {
+		for (j = 0; j < n_patterns; j++)
+			if (!fnmatch(patterns[j], ue->sysnames[i], 0))
+				break;
+
+		if (j == n_patterns)
+			continue;
+
+		*sysnamesp = reallocarray(*sysnamesp, *np + 1, sizeof(**sysnamesp));
+		assert(*sysnamesp);
+		(*sysnamesp)[(*np)++] = ue->sysnames[i];
 	}
 
-	ev_io_init(&uddev->ev, uddev_ev_cb, udev_monitor_get_fd(uddev->mon), EV_READ);
 	return 0;
+}
 
-err:
-	if (uddev->mon)
-		udev_monitor_unref(uddev->mon);
+/* Release the table once probing is done, as it will go stale as
+ * soon as devices come and go. */
+void uddev_enum_done(void)
+{
+	struct hnode *hn, *next;
+	struct uddev_ent *ent;
+	size_t i;
+
+	for (i = 0; i < g_enum.ents.n_bkts; i++) {
+		for (hn = g_enum.ents.bkts[i]; hn; hn = next) {
+			next = hn->next;
+			ent = container_of(hn, struct uddev_ent, node);
+			free(ent->syspath);
+			free(ent);
+		}
+	}
 
-	if (uddev->dev)
-		udev_device_unref(uddev->dev);
+	free(g_enum.ents.bkts);
 
-	if (uddev->ud)
-		udev_unref(uddev->ud);
+	for (i = 0; i < g_enum.n_enums; i++)
+		free(g_enum.enums[i].sysnames);
 
-	return err;
+	free(g_enum.enums);
+	memset(&g_enum, 0, sizeof(g_enum));
+}
+
+int uddev_start(struct uddev *uddev)
+{
+	htab_add(&g_mon.uddevs, &uddev->node, uddev->sysname);
+	ev_prepare_start(ev_default_loop(0), &g_mon.sync);
+
+	if (g_mon.started)
+		return 0;
+
+	if (udev_monitor_enable_receiving(g_mon.mon)) {
+		uddev_err(uddev, "Unable to start monitor");
+		return -EINVAL;
+	}
+
+	ev_io_start(ev_default_loop(0), &g_mon.ev);
+	g_mon.started = true;
+	return 0;
+}
+
+int uddev_init(struct uddev *uddev)
+{
+	int err;
+
+	err = uddev_mon_init();
+	if (err)
+		return err;
+
+	if (uddev_mon_add_subsys(uddev->subsys)) {
+		uddev_err(uddev, "Unable to apply subsystem filter");
+		return -ENOSYS;
+	}
+
+	uddev->dev = uddev_enum_get(uddev->subsys, uddev->sysname);
+	if (!uddev->dev)
+		uddev_dbg(uddev, "Not available");
+	else if (g_mon.kfilter)
+		uddev_kfilter_track(uddev->dev);
+
+	return 0;
 }
@@ -45,6 +45,24 @@ uled()
 	    echo "Expected state ($1 $2 $3 $4) does not match current state (${last[*]})" >&2
 	    return 1
 	    ;;
+	hold)
+	    # Succeed if the state does not change away from the
+	    # expected one for the given number of seconds
+	    secs=$2
+	    shift 2
+	    while read -u 10 -t $secs -a led; do
+		ledcmp $1 ${led[0]} && \
+		ledcmp $2 ${led[1]} && \
+		ledcmp $3 ${led[2]} && \
+		ledcmp $4 ${led[3]} && \
+		continue
+
+		echo "Expected state ($1 $2 $3 $4) to hold, but it changed to (${led[*]})" >&2
+		return 1
+	    done
+
+	    return 0
+	    ;;
 	*)
 	    die "Unknown uled command"
 	    ;;
@@ -205,11 +223,208 @@ EOF
     wait $pid || true
 }
 
+test_compound()
+{
+    f1=$(mktemp)
+    f2=$(mktemp)
+
+    $IITOD <<EOF &
+{
+	"input": {
+		"path": {
+			"f1": { "path": "${f1}" },
+			"f2": { "path": "${f2}" }
+		}
+	},
+
+	"output": {
+		"led": {
+			"iito-test::1": {
+				"rules": [
+					{ "if": "f1 && !f2",   "then": { "brightness": 1 } },
+					{ "if": "!(f1 || f2)", "then": { "brightness": 2 } }
+				]
+			},
+			"iito-test::2": {
+				"rules": [
+					{ "if": "!f2 && f1", "then": { "brightness": true } }
+				]
+			}
+		}
+	}
+}
+EOF
+    pid=$!
+
+    echo "Both f1 and f2 exists"
+    uled expect x 0 0 x || return 1
+
+    echo "Remove f2"
+    rm $f2
+    uled expect x 1 127 x || return 1
+
+    echo "Remove f1"
+    rm $f1
+    uled expect x 2 0 x || return 1
+
+    kill $pid
+    wait $pid || true
+}
+
+test_flags()
+{
+    flags=$(mktemp)
+    echo "boot-ok=1" >$flags
+
+    $IITOD <<EOF &
+{
+	"input": {
+		"flags": {
+			"flags": { "path": "${flags}" }
+		}
+	},
+
+	"output": {
+		"led": {
+			"iito-test::1": {
+				"rules": [
+					{ "if": "flags:panic",   "then": { "brightness": 1 } },
+					{ "if": "flags:boot-ok", "then": { "brightness": 2 } }
+				]
+			}
+		}
+	}
+}
+EOF
+    pid=$!
+
+    echo "Boot OK"
+    uled expect x 2 x x || return 1
+
+    echo "Panic, replacing the file"
+    printf "boot-ok=1\npanic=1\n" >$flags.new
+    mv $flags.new $flags
+    uled expect x 1 x x || return 1
+
+    echo "No flags, rewriting the file"
+    echo "boot-ok=0" >$flags
+    uled expect x 0 x x || return 1
+
+    kill $pid
+    wait $pid || true
+    rm -f $flags
+}
+
+test_pid()
+{
+    pidfile=$(mktemp)
+    sleep 1000 &
+    echo $! >$pidfile
+
+    $IITOD <<EOF &
+{
+	"input": {
+		"pid": {
+			"sleeper": { "pidfile": "${pidfile}" }
+		}
+	},
+
+	"output": {
+		"led": {
+			"iito-test::1": {
+				"rules": [
+					{ "if": "sleeper", "then": { "brightness": true } }
+				]
+			}
+		}
+	}
+}
+EOF
+    pid=$!
+
+    echo "Process is running"
+    uled expect x 15 x x || return 1
+
+    echo "Kill process, leaving a stale pidfile"
+    kill $(cat $pidfile)
+    uled expect x 0 x x || return 1
+
+    echo "Restart process"
+    sleep 1000 &
+    echo $! >$pidfile
+    uled expect x 15 x x || return 1
+
+    kill $(cat $pidfile)
+    kill $pid
+    wait $pid || true
+    rm -f $pidfile
+}
+
+test_sysfs()
+{
+    temp=$(mktemp)
+    echo 50 >$temp
+
+    $IITOD <<EOF &
+{
+	"input": {
+		"sysfs": {
+			"temp": {
+				"path": "${temp}",
+				"interval": 100,
+				"thresholds": {
+					"hot": { "on": 80, "off": 70 }
+				}
+			}
+		}
+	},
+
+	"output": {
+		"led": {
+			"iito-test::1": {
+				"rules": [
+					{ "if": "temp:hot", "then": { "brightness": 1 } }
+				]
+			}
+		}
+	}
+}
+EOF
+    pid=$!
+
+    echo "Below the band"
+    uled expect x 0 x x || return 1
+
+    echo "Rise into the band, stays off"
+    echo 75 >$temp
+    uled hold 1 x 0 x x || return 1
+
+    echo "Rise above the band"
+    echo 85 >$temp
+    uled expect x 1 x x || return 1
+
+    echo "Fall into the band, stays on"
+    echo 75 >$temp
+    uled hold 1 x 1 x x || return 1
+
+    echo "Fall below the band"
+    echo 65 >$temp
+    uled expect x 0 x x || return 1
+
+    echo "Leading zeros are not octal"
+    echo 0100 >$temp
+    uled expect x 1 x x || return 1
+
+    kill $pid
+    wait $pid || true
+    rm -f $temp
+}
+
 modprobe uleds || die "uleds module not available"
 
 [ "$IITOD" ] || die "\$IITOD is not set"
 
-for t in self path udev alias; do
+for t in self path udev alias compound flags pid sysfs; do
     uled start
 
     printf ">>> START \"%s\"\n" "$t"